@@ -0,0 +1,244 @@
+/*
+ * MIDI2GPIOD
+ *
+ * System announcements.
+ *
+ * The sequencer announces clients and ports coming and going, and
+ * connections made and broken, on the System:Announce port.  We receive
+ * them on a second sequencer client of our own, read by a thread at the
+ * lowest scheduling priority, so that the client carrying the notes
+ * only ever wakes the main loop for music, and connection churn
+ * elsewhere in the ALSA graph never delays a note.
+ *
+ * When the source appears, the thread connects it to our data port.  It
+ * does so from the announce client, the way aconnect connects two other
+ * clients.  When the source goes away, the thread wakes the main loop
+ * through an eventfd and the main loop panics: the outputs are only
+ * ever touched from there.
+ *
+ * McLaren Labs
+ * 2021
+ *
+ */
+
+#define _GNU_SOURCE		// SCHED_IDLE
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "midi2gpiod.h"
+
+#define ANNOUNCE_MAX_FDS	8
+
+unsigned long stat_source_lost;
+
+static snd_seq_t *aseq;
+static pthread_t announce_thread;
+static int announce_running;
+static int lost_fd = -1;	// thread to main loop: the source went away
+static int stop_fd = -1;	// main loop to thread: time to go
+
+/*
+ * Create the announce client and subscribe it to System:Announce.
+ * Returns 0, or the ALSA error with nothing left open.
+ */
+
+int announce_open(void)
+{
+  int err, port;
+
+  err = snd_seq_open(&aseq, sequencer_type, SND_SEQ_OPEN_INPUT, SND_SEQ_NONBLOCK);
+  if (check_snd_err("snd_seq_open (announce)", err) < 0) {
+    aseq = NULL;
+    return err;
+  }
+
+  snd_seq_set_client_name(aseq, "midi2gpiod announce");
+
+  port = snd_seq_create_simple_port(aseq, "announce",
+				    SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_NO_EXPORT,
+				    SND_SEQ_PORT_TYPE_APPLICATION);
+  if (check_snd_err("snd_seq_create_simple_port (announce)", port) < 0) {
+    err = port;
+    goto fail;
+  }
+
+  err = snd_seq_connect_from(aseq, port, SND_SEQ_CLIENT_SYSTEM, SND_SEQ_PORT_SYSTEM_ANNOUNCE);
+  if (check_snd_err("snd_seq_connect_from (in subscribe)", err) < 0)
+    goto fail;
+
+  return 0;
+
+ fail:
+  snd_seq_close(aseq);
+  aseq = NULL;
+  return err;
+}
+
+/*
+ * Is `ev` the loss of our source?
+ */
+
+static int source_lost(const snd_seq_event_t *ev)
+{
+  int source_client, source_port;
+
+  if (!source_get(&source_client, &source_port))
+    return 0;
+
+  switch (ev->type) {
+  case SND_SEQ_EVENT_CLIENT_EXIT:
+    return ev->data.addr.client == source_client;
+  case SND_SEQ_EVENT_PORT_EXIT:
+    return ev->data.addr.client == source_client &&
+      ev->data.addr.port == source_port;
+  case SND_SEQ_EVENT_PORT_UNSUBSCRIBED:
+    return ev->data.connect.sender.client == source_client &&
+      ev->data.connect.sender.port == source_port &&
+      ev->data.connect.dest.client == seq_client &&
+      ev->data.connect.dest.port == seq_port0;
+  }
+  return 0;
+}
+
+static void announce_event(const snd_seq_event_t *ev)
+{
+  uint64_t one = 1;
+  int client, port;
+
+  if (verbose)
+    log_event(ev);
+
+  switch (ev->type) {
+
+  case SND_SEQ_EVENT_CLIENT_START:
+  case SND_SEQ_EVENT_PORT_START:
+    if (!source_get(&client, &port))
+      connect_from_rtpmidi_port(aseq);
+    break;
+
+  case SND_SEQ_EVENT_CLIENT_EXIT:
+  case SND_SEQ_EVENT_PORT_EXIT:
+  case SND_SEQ_EVENT_PORT_UNSUBSCRIBED:
+    if (source_lost(ev)) {
+      source_set(-1, 0);
+      stat_source_lost++;
+      if (write(lost_fd, &one, sizeof(one)) < 0)
+	perror("announce");
+    }
+    break;
+  }
+}
+
+static void *announce_main(void *arg)
+{
+  struct pollfd pfds[ANNOUNCE_MAX_FDS + 1];
+  snd_seq_event_t *ev;
+  int n, err;
+
+  n = snd_seq_poll_descriptors(aseq, pfds, ANNOUNCE_MAX_FDS, POLLIN);
+  pfds[n].fd = stop_fd;
+  pfds[n].events = POLLIN;
+
+  for (;;) {
+    if (poll(pfds, n + 1, -1) < 0) {
+      if (errno == EINTR)
+	continue;
+      perror("announce");
+      break;
+    }
+
+    if (pfds[n].revents & POLLIN)
+      break;
+
+    do {
+      err = snd_seq_event_input(aseq, &ev);
+      if (err < 0)
+	break;
+      if (ev)
+	announce_event(ev);
+    } while (err > 0);
+  }
+
+  return NULL;
+}
+
+/*
+ * Start the announce thread.  Returns 0, or -1 on error.
+ */
+
+int announce_start(void)
+{
+  struct sched_param param = { 0 };
+  pthread_attr_t attr;
+  int err;
+
+  lost_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (lost_fd < 0 || stop_fd < 0) {
+    perror("eventfd");
+    return -1;
+  }
+
+  // SCHED_IDLE needs no privileges; fall back to the default if it fails
+  pthread_attr_init(&attr);
+  pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+  pthread_attr_setschedpolicy(&attr, SCHED_IDLE);
+  pthread_attr_setschedparam(&attr, &param);
+  err = pthread_create(&announce_thread, &attr, announce_main, NULL);
+  pthread_attr_destroy(&attr);
+  if (err)
+    err = pthread_create(&announce_thread, NULL, announce_main, NULL);
+  if (err) {
+    fprintf(stderr, "announce thread: %s\n", strerror(err));
+    return -1;
+  }
+
+  announce_running = 1;
+  return 0;
+}
+
+void announce_close(void)
+{
+  uint64_t one = 1;
+
+  if (announce_running) {
+    if (write(stop_fd, &one, sizeof(one)) < 0)
+      perror("announce");
+    pthread_join(announce_thread, NULL);
+    announce_running = 0;
+  }
+
+  if (aseq)
+    snd_seq_close(aseq);
+  aseq = NULL;
+  if (lost_fd >= 0)
+    close(lost_fd);
+  if (stop_fd >= 0)
+    close(stop_fd);
+  lost_fd = stop_fd = -1;
+}
+
+int announce_poll_descriptor(struct pollfd *pfd)
+{
+  pfd->fd = lost_fd;
+  pfd->events = POLLIN;
+  pfd->revents = 0;
+  return 1;
+}
+
+/*
+ * From the main loop: the thread saw the source go away.
+ */
+
+void announce_handle(const struct pollfd *pfd)
+{
+  uint64_t n;
+
+  if (!(pfd->revents & POLLIN))
+    return;
+
+  if (read(lost_fd, &n, sizeof(n)) == sizeof(n))
+    panic("source disconnected");
+}
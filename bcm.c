@@ -0,0 +1,156 @@
+/*
+ * MIDI2GPIOD
+ *
+ * BCM283x register backend.
+ *
+ * On the native header of a Raspberry Pi the GPIO registers can be
+ * mapped into the program through /dev/gpiomem.  A commit is then one
+ * store to GPSET0 with the lines to turn on and one to GPCLR0 with the
+ * lines to turn off, no system call and no trip through gpiolib.
+ * Lines are numbered as on the BCM chip (GPIO17 is line 17); the bit of
+ * every output is computed when the chip is opened.
+ *
+ *   chip pi bcm2835 /dev/gpiomem
+ *   output relay1 pi 17
+ *
+ * Any file of at least 4 KB can stand in for the device, to test a
+ * configuration on a machine without one.
+ *
+ * McLaren Labs
+ * 2021
+ *
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "midi2gpiod.h"
+
+#define BCM_BLOCK	4096
+#define BCM_LINES	54
+
+// register offsets, in 32-bit words
+#define GPFSEL0		0
+#define GPSET0		7
+#define GPCLR0		10
+
+struct bcm {
+  volatile uint32_t	*regs;
+  uint32_t		bit[MAX_OUTPUTS];	// of every output on the chip
+  unsigned char		bank[MAX_OUTPUTS];	// 0 for lines 0-31, 1 for 32-53
+};
+
+static int bcm_write(struct out_chip *ch, const struct outset *state)
+{
+  struct bcm *b = ch->priv;
+  uint32_t set[2] = { 0, 0 }, clr[2] = { 0, 0 };
+  int i;
+
+  for (i = 0; i < ch->nouts; i++) {
+    if (outset_test(state, ch->outs[i]))
+      set[b->bank[i]] |= b->bit[i];
+    else
+      clr[b->bank[i]] |= b->bit[i];
+  }
+
+  if (set[0])
+    b->regs[GPSET0] = set[0];
+  if (clr[0])
+    b->regs[GPCLR0] = clr[0];
+  if (set[1])
+    b->regs[GPSET0 + 1] = set[1];
+  if (clr[1])
+    b->regs[GPCLR0 + 1] = clr[1];
+  return 0;
+}
+
+/*
+ * Map the registers and make every output line an output, at its
+ * initial value.  Returns 1 on success.
+ */
+
+static int bcm_open(struct out_chip *ch)
+{
+  const char *path = ch->path ? ch->path : "/dev/gpiomem";
+  struct bcm *b;
+  struct stat st;
+  uint32_t fsel;
+  int fd, i;
+
+  b = calloc(1, sizeof(*b));
+  if (!b) {
+    perror("bcm");
+    return 0;
+  }
+
+  fd = open(path, O_RDWR | O_SYNC | O_CLOEXEC);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    fprintf(stderr, "Open chip '%s' (%s) failed: %s\n", ch->name, path, strerror(errno));
+    goto fail;
+  }
+
+  if (S_ISREG(st.st_mode) && st.st_size < BCM_BLOCK) {
+    fprintf(stderr, "Chip '%s': %s is too small for the GPIO registers\n", ch->name, path);
+    goto fail;
+  }
+
+  b->regs = mmap(NULL, BCM_BLOCK, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (b->regs == MAP_FAILED) {
+    fprintf(stderr, "Map chip '%s' (%s) failed: %s\n", ch->name, path, strerror(errno));
+    goto fail;
+  }
+  close(fd);
+
+  for (i = 0; i < ch->nouts; i++) {
+    unsigned int line = outputs[ch->outs[i]].offset;
+
+    if (line >= BCM_LINES) {
+      fprintf(stderr, "Chip '%s' has no line %u\n", ch->name, line);
+      munmap((void *) b->regs, BCM_BLOCK);
+      free(b);
+      return 0;
+    }
+
+    b->bit[i] = 1U << (line & 31);
+    b->bank[i] = line >> 5;
+  }
+
+  // levels first, so the lines come up with their initial values
+  ch->priv = b;
+  bcm_write(ch, &out_state);
+
+  for (i = 0; i < ch->nouts; i++) {
+    unsigned int line = outputs[ch->outs[i]].offset;
+
+    // three function select bits per line; 001 is output
+    fsel = b->regs[GPFSEL0 + line / 10];
+    fsel &= ~(7U << (line % 10 * 3));
+    fsel |= 1U << (line % 10 * 3);
+    b->regs[GPFSEL0 + line / 10] = fsel;
+  }
+  return 1;
+
+ fail:
+  if (fd >= 0)
+    close(fd);
+  free(b);
+  return 0;
+}
+
+static void bcm_close(struct out_chip *ch)
+{
+  struct bcm *b = ch->priv;
+
+  munmap((void *) b->regs, BCM_BLOCK);
+  free(b);
+  ch->priv = NULL;
+}
+
+const struct chip_ops bcm_ops = {
+  .type		= "bcm2835",
+  .max_lines	= BCM_LINES,
+  .open		= bcm_open,
+  .write	= bcm_write,
+  .close	= bcm_close,
+};
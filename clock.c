@@ -0,0 +1,265 @@
+/*
+ * MIDI2GPIOD
+ *
+ * MIDI clock follower and beat-synced generators.
+ *
+ * MIDI clock arrives as 24 SND_SEQ_EVENT_CLOCK per quarter note.  Over
+ * a network those ticks are jittery, so we do not act on them directly.
+ * Instead a phase-locked loop estimates the tick period and predicts
+ * when the next tick is due.  Each arriving tick nudges the prediction
+ * (phase) by a fraction of the error, and the period by a smaller
+ * fraction, which filters the jitter while following tempo changes.
+ *
+ * Generators drive outputs in time with the beat.  The time of each
+ * generator step is computed from the PLL and scheduled on the timer
+ * wheel ahead of time; every tick refines the schedule, but the step
+ * itself happens at the predicted time, not when a tick happens to
+ * arrive.
+ *
+ *   strobe	all outputs flash for `width` ms on every step
+ *   chase	one output at a time, advancing on every step
+ *   gate	all outputs are on for `duty` percent of every step
+ *
+ * McLaren Labs
+ * 2021
+ *
+ */
+
+#include "midi2gpiod.h"
+
+#define PPQN		24
+
+// loop gains: fraction of the error applied to phase and to period
+#define PLL_ALPHA	0.125
+#define PLL_BETA	0.015625
+
+// accepted tempo range, as tick periods
+#define PERIOD_MIN	(60e9 / (400 * PPQN))
+#define PERIOD_MAX	(60e9 / (20 * PPQN))
+
+struct generator generators[MAX_GENERATORS];
+int ngenerators;
+
+struct midi_clock midi_clock;
+
+unsigned long stat_clock_ticks;
+unsigned long stat_clock_resyncs;
+
+static void generator_step_expired(struct timer *t);
+static void generator_off_expired(struct timer *t);
+
+struct generator *generator_add(const char *name, enum gen_type type)
+{
+  struct generator *g;
+
+  if (ngenerators == MAX_GENERATORS) {
+    fprintf(stderr, "Too many generators (max %d)\n", MAX_GENERATORS);
+    return NULL;
+  }
+
+  g = &generators[ngenerators++];
+  g->name = strdup(name);
+  g->type = type;
+  g->nouts = 0;
+  g->every = PPQN;
+  g->width = 20;
+  g->duty = 50;
+  g->step = 0;
+  timer_init(&g->step_timer, generator_step_expired);
+  timer_init(&g->off_timer, generator_off_expired);
+  return g;
+}
+
+/*
+ * Predicted time of clock tick `n`.
+ */
+
+static uint64_t clock_tick_time(uint64_t n)
+{
+  struct midi_clock *c = &midi_clock;
+  return c->next_ns + (int64_t) ((double) (int64_t) (n - c->pos) * c->period);
+}
+
+double clock_bpm(void)
+{
+  if (midi_clock.period <= 0)
+    return 0;
+  return 60e9 / (midi_clock.period * PPQN);
+}
+
+static void generator_all(struct generator *g, int value)
+{
+  int i;
+
+  for (i = 0; i < g->nouts; i++)
+    output_set(g->outs[i], value);
+}
+
+/*
+ * Schedule the next step of a generator from the current estimate.
+ */
+
+static void generator_schedule(struct generator *g)
+{
+  timer_add_ns(&g->step_timer, clock_tick_time(g->step * g->every));
+}
+
+static void generator_fire(struct generator *g)
+{
+  int i;
+
+  switch (g->type) {
+
+  case GEN_STROBE:
+    for (i = 0; i < g->nouts; i++)
+      output_pulse(g->outs[i], g->width);
+    break;
+
+  case GEN_CHASE:
+    for (i = 0; i < g->nouts; i++)
+      output_set(g->outs[i], (unsigned) i == g->step % g->nouts);
+    break;
+
+  case GEN_GATE:
+    generator_all(g, 1);
+    timer_add_ns(&g->off_timer, now_ns() +
+		 (uint64_t) (midi_clock.period * g->every * g->duty / 100));
+    break;
+  }
+
+  g->step++;
+}
+
+static void generator_step_expired(struct timer *t)
+{
+  struct generator *g = container_of(t, struct generator, step_timer);
+
+  if (!midi_clock.running)
+    return;
+
+  generator_fire(g);
+  generator_schedule(g);
+}
+
+static void generator_off_expired(struct timer *t)
+{
+  struct generator *g = container_of(t, struct generator, off_timer);
+
+  generator_all(g, 0);
+}
+
+static void generators_stop(void)
+{
+  int i;
+
+  for (i = 0; i < ngenerators; i++) {
+    struct generator *g = &generators[i];
+    timer_del(&g->step_timer);
+    timer_del(&g->off_timer);
+    if (g->type != GEN_STROBE)
+      generator_all(g, 0);
+  }
+}
+
+/*
+ * Move every generator to the first step at or after tick `pos`.
+ */
+
+static void generators_locate(uint64_t pos)
+{
+  int i;
+
+  for (i = 0; i < ngenerators; i++) {
+    struct generator *g = &generators[i];
+    g->step = (pos + g->every - 1) / g->every;
+  }
+}
+
+/*
+ * A clock tick arrived at time `t`.  Update the loop and refine the
+ * schedule of every generator.
+ */
+
+void clock_tick(uint64_t t)
+{
+  struct midi_clock *c = &midi_clock;
+  uint64_t n = c->pos;
+  int64_t err;
+  int i;
+
+  stat_clock_ticks++;
+
+  if (c->period == 0) {
+    // no estimate yet: the first two ticks give one
+    if (c->last_ns) {
+      double p = (double) (t - c->last_ns);
+      if (p >= PERIOD_MIN && p <= PERIOD_MAX)
+	c->period = p;
+    }
+    c->next_ns = t;
+  }
+  else {
+    err = (int64_t) (t - c->next_ns);
+    if (err > 2 * c->period || err < -2 * c->period) {
+      // lost lock, e.g. after a pause in the clock: start over from here
+      stat_clock_resyncs++;
+      c->next_ns = t;
+    }
+    else {
+      c->period += PLL_BETA * err;
+      if (c->period < PERIOD_MIN)
+	c->period = PERIOD_MIN;
+      if (c->period > PERIOD_MAX)
+	c->period = PERIOD_MAX;
+      c->next_ns += (int64_t) (PLL_ALPHA * err);
+    }
+  }
+  c->last_ns = t;
+
+  // next_ns now estimates tick n; advance the prediction to n+1
+  c->next_ns += (uint64_t) c->period;
+  c->pos = n + 1;
+
+  if (!c->running)
+    return;
+
+  for (i = 0; i < ngenerators; i++) {
+    struct generator *g = &generators[i];
+
+    // without an estimate yet, follow the ticks as they come; a step
+    // scheduled late still fires on the next tick of the wheel
+    if (c->period)
+      generator_schedule(g);
+    else if (g->step * g->every <= n)
+      generator_fire(g);
+  }
+}
+
+void clock_start(void)
+{
+  midi_clock.pos = 0;
+  midi_clock.running = 1;
+  generators_locate(0);
+}
+
+void clock_continue(void)
+{
+  midi_clock.running = 1;
+  generators_locate(midi_clock.pos);
+}
+
+void clock_stop(void)
+{
+  midi_clock.running = 0;
+  generators_stop();
+}
+
+/*
+ * Song Position Pointer, in sixteenth notes.
+ */
+
+void clock_songpos(int sixteenths)
+{
+  midi_clock.pos = (uint64_t) sixteenths * (PPQN / 4);
+  generators_locate(midi_clock.pos);
+}
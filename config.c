@@ -0,0 +1,647 @@
+/*
+ * MIDI2GPIOD
+ *
+ * Configuration file.  The file is line oriented; each line holds a
+ * keyword, positional arguments and optional key=value settings.
+ * Everything after a '#' is a comment.
+ *
+ *   output relay1 gpiochip0 25
+ *   output kick   gpiochip0 5
+ *
+ *   note 60 relay1
+ *   note 36 kick pulse=20
+ *   note 38 kick pulse=5-30 channel=10
+ *
+ * `output NAME CHIP LINE` declares an output line.  CHIP is a gpiochip,
+ * unless it was declared before by `chip NAME TYPE [DEVICE] [key=value
+ * ...]` to be written through another backend:
+ *
+ *   bcm2835	the registers of the Raspberry Pi, through /dev/gpiomem
+ *   74hc595	a chain of shift registers on spidev [speed=HZ length=N]
+ *   mcp23017	an I2C expander on i2c-dev [address=N]
+ *   pca9555	an I2C expander on i2c-dev [address=N]
+ *   artnet	a DMX universe sent to ADDRESS [universe=N refresh=MS port=N]
+ *   sacn	a DMX universe sent to ADDRESS [universe=N refresh=MS port=N]
+ *
+ * `note NOTE OUTPUT` maps a note to an output.  Settings of a note
+ * mapping are:
+ *
+ *   channel=N	only match MIDI channel N (1..16), default any
+ *   pulse=MS	pulse mode: Note-On turns the output on for MS milliseconds
+ *   pulse=A-B	pulse width scaled by velocity from A (soft) to B (loud)
+ *   maxhold=MS	hold mode: turn the output off if no Note-Off arrives
+ *		within MS milliseconds
+ *
+ * `cc CC OUTPUT [channel=N]` maps a controller to the level of an
+ * output: 0 turns it off, and other values turn it on at that level,
+ * which DMX outputs send.
+ *
+ * `input NAME CHIP LINE` declares an input line whose edges are sent as
+ * notes on our seq port.  Settings of an input are:
+ *
+ *   note=N	note to send, default 60
+ *   channel=N	MIDI channel (1..16), default 1
+ *   velocity=N	Note-On velocity, default 100
+ *   active=low	a falling edge is Note-On (default active=high)
+ *   bias=B	pull-up, pull-down or disable
+ *   debounce=MS	ignore bounces shorter than MS milliseconds
+ *
+ * `generator NAME TYPE OUTPUT[,OUTPUT...]` drives outputs in time with
+ * the MIDI clock.  TYPE is strobe, chase or gate.  Settings are:
+ *
+ *   every=N	clock ticks per step (24 per quarter note), default 24
+ *   width=MS	strobe: flash width, default 20
+ *   duty=PCT	gate: percent of each step the outputs are on, default 50
+ *
+ * `cue HH:MM:SS:FF OUTPUT ACTION` changes an output when MIDI Time Code
+ * passes the given time.  ACTION is on, off or pulse=MS.
+ *
+ * `pattern NAME [repeat=N]` starts a pattern, and the `step DELAY
+ * [+OUTPUT ...] [-OUTPUT ...]` lines that follow are its steps: wait
+ * DELAY ms, then turn on the + outputs and off the - outputs.  A pattern
+ * plays N times (default 1); repeat=0 loops while the note is held.
+ * `note NOTE pattern=NAME` launches it.
+ *
+ * Without a configuration file, the built-in defaults map middle-C, D
+ * and E to lines 25, 26 and 27 of gpiochip0.
+ *
+ * McLaren Labs
+ * 2021
+ *
+ */
+
+#include <ctype.h>
+#include "midi2gpiod.h"
+
+char *config_file = NULL;
+
+#define MAX_ARGS	16
+
+static const char *cfg_path;
+static int cfg_lineno;
+
+static void cfg_error(const char *msg, const char *arg)
+{
+  fprintf(stderr, "%s:%d: %s '%s'\n", cfg_path, cfg_lineno, msg, arg);
+}
+
+static int parse_int(const char *s, int min, int max, int *val)
+{
+  char *end;
+  long v = strtol(s, &end, 0);
+
+  if (*s == '\0' || *end != '\0' || v < min || v > max)
+    return -1;
+  *val = v;
+  return 0;
+}
+
+/*
+ * Split `line` into whitespace separated words, stopping at a comment.
+ */
+
+static int split(char *line, char **argv)
+{
+  int argc = 0;
+  char *p = line;
+
+  for (;;) {
+    while (isspace((unsigned char) *p))
+      p++;
+    if (*p == '\0' || *p == '#')
+      break;
+    if (argc == MAX_ARGS)
+      break;
+    argv[argc++] = p;
+    while (*p && !isspace((unsigned char) *p) && *p != '#')
+      p++;
+    if (*p == '#') {
+      *p = '\0';
+      break;
+    }
+    if (*p)
+      *p++ = '\0';
+  }
+
+  return argc;
+}
+
+static int parse_chip(int argc, char **argv)
+{
+  struct out_chip *ch;
+  const char *path = NULL;
+  int i = 3;
+
+  if (argc < 3) {
+    cfg_error("usage: chip NAME TYPE [DEVICE] [key=value ...], got", argv[0]);
+    return -1;
+  }
+
+  if (argc > 3 && !strchr(argv[3], '='))
+    path = argv[i++];
+
+  ch = chip_declare(argv[1], argv[2], path);
+  if (!ch)
+    return -1;
+
+  for (; i < argc; i++) {
+    char *val = strchr(argv[i], '=');
+    if (!val) {
+      cfg_error("expected key=value, got", argv[i]);
+      return -1;
+    }
+    *val++ = '\0';
+
+    if (!ch->ops->setting || ch->ops->setting(ch, argv[i], val) < 0) {
+      cfg_error("bad setting", argv[i]);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int parse_output(int argc, char **argv)
+{
+  int line;
+
+  if (argc != 4) {
+    cfg_error("usage: output NAME CHIP LINE, got", argv[0]);
+    return -1;
+  }
+
+  if (parse_int(argv[3], 0, 65535, &line) < 0) {
+    cfg_error("bad line number", argv[3]);
+    return -1;
+  }
+
+  return output_add(argv[1], argv[2], line) < 0 ? -1 : 0;
+}
+
+static int parse_pulse(struct mapping *m, const char *val)
+{
+  char buf[32];
+  char *dash;
+  int a, b;
+
+  snprintf(buf, sizeof(buf), "%s", val);
+  dash = strchr(buf, '-');
+  if (dash)
+    *dash++ = '\0';
+
+  if (parse_int(buf, 1, 60000, &a) < 0)
+    return -1;
+  b = a;
+  if (dash && parse_int(dash, a, 60000, &b) < 0)
+    return -1;
+
+  m->mode = MAP_PULSE;
+  m->width_min = a;
+  m->width_max = b;
+  return 0;
+}
+
+static int parse_note(int argc, char **argv)
+{
+  struct mapping *m;
+  int note, out, ch, ms, i;
+
+  if (argc < 3) {
+    cfg_error("usage: note NOTE OUTPUT|pattern=NAME [key=value ...], got", argv[0]);
+    return -1;
+  }
+
+  if (parse_int(argv[1], 0, 127, &note) < 0) {
+    cfg_error("bad note number", argv[1]);
+    return -1;
+  }
+
+  if (strncmp(argv[2], "pattern=", 8) == 0) {
+    struct pattern *p = pattern_find(argv[2] + 8);
+    if (!p) {
+      cfg_error("unknown pattern", argv[2] + 8);
+      return -1;
+    }
+    m = mapping_add(note, -1);
+    if (!m)
+      return -1;
+    m->mode = MAP_PATTERN;
+    m->pattern = p;
+  }
+  else {
+    out = output_find(argv[2]);
+    if (out < 0) {
+      cfg_error("unknown output", argv[2]);
+      return -1;
+    }
+    m = mapping_add(note, out);
+    if (!m)
+      return -1;
+  }
+
+  for (i = 3; i < argc; i++) {
+    char *val = strchr(argv[i], '=');
+    if (!val) {
+      cfg_error("expected key=value, got", argv[i]);
+      return -1;
+    }
+    *val++ = '\0';
+
+    if (m->mode == MAP_PATTERN && strcmp(argv[i], "channel") != 0) {
+      cfg_error("only channel applies to a pattern, got", argv[i]);
+      return -1;
+    }
+
+    if (strcmp(argv[i], "channel") == 0) {
+      if (parse_int(val, 1, 16, &ch) < 0) {
+	cfg_error("bad channel", val);
+	return -1;
+      }
+      m->channel = ch - 1;
+    }
+    else if (strcmp(argv[i], "pulse") == 0) {
+      if (parse_pulse(m, val) < 0) {
+	cfg_error("bad pulse width", val);
+	return -1;
+      }
+    }
+    else if (strcmp(argv[i], "maxhold") == 0) {
+      if (parse_int(val, 1, 86400000, &ms) < 0) {
+	cfg_error("bad maximum hold time", val);
+	return -1;
+      }
+      m->maxhold = ms;
+    }
+    else {
+      cfg_error("unknown setting", argv[i]);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int parse_cc(int argc, char **argv)
+{
+  struct mapping *m;
+  int cc, out, ch;
+
+  if (argc < 3 || argc > 4) {
+    cfg_error("usage: cc CC OUTPUT [channel=N], got", argv[0]);
+    return -1;
+  }
+
+  if (parse_int(argv[1], 0, 127, &cc) < 0) {
+    cfg_error("bad controller number", argv[1]);
+    return -1;
+  }
+
+  out = output_find(argv[2]);
+  if (out < 0) {
+    cfg_error("unknown output", argv[2]);
+    return -1;
+  }
+
+  m = mapping_add_cc(cc, out);
+  if (!m)
+    return -1;
+
+  if (argc == 4) {
+    if (strncmp(argv[3], "channel=", 8) != 0 || parse_int(argv[3] + 8, 1, 16, &ch) < 0) {
+      cfg_error("bad setting", argv[3]);
+      return -1;
+    }
+    m->channel = ch - 1;
+  }
+
+  return 0;
+}
+
+static int parse_input(int argc, char **argv)
+{
+  struct input *in;
+  int line, v, i;
+
+  if (argc < 4) {
+    cfg_error("usage: input NAME CHIP LINE [key=value ...], got", argv[0]);
+    return -1;
+  }
+
+  if (parse_int(argv[3], 0, 65535, &line) < 0) {
+    cfg_error("bad line number", argv[3]);
+    return -1;
+  }
+
+  in = input_add(argv[1], argv[2], line);
+  if (!in)
+    return -1;
+
+  for (i = 4; i < argc; i++) {
+    char *val = strchr(argv[i], '=');
+    if (!val) {
+      cfg_error("expected key=value, got", argv[i]);
+      return -1;
+    }
+    *val++ = '\0';
+
+    if (strcmp(argv[i], "note") == 0 && parse_int(val, 0, 127, &v) == 0)
+      in->note = v;
+    else if (strcmp(argv[i], "channel") == 0 && parse_int(val, 1, 16, &v) == 0)
+      in->channel = v - 1;
+    else if (strcmp(argv[i], "velocity") == 0 && parse_int(val, 1, 127, &v) == 0)
+      in->velocity = v;
+    else if (strcmp(argv[i], "debounce") == 0 && parse_int(val, 0, 1000, &v) == 0)
+      in->debounce = v;
+    else if (strcmp(argv[i], "active") == 0 && strcmp(val, "low") == 0)
+      in->invert = 1;
+    else if (strcmp(argv[i], "active") == 0 && strcmp(val, "high") == 0)
+      in->invert = 0;
+    else if (strcmp(argv[i], "bias") == 0 && strcmp(val, "pull-up") == 0)
+      in->flags = GPIOD_LINE_REQUEST_FLAG_BIAS_PULL_UP;
+    else if (strcmp(argv[i], "bias") == 0 && strcmp(val, "pull-down") == 0)
+      in->flags = GPIOD_LINE_REQUEST_FLAG_BIAS_PULL_DOWN;
+    else if (strcmp(argv[i], "bias") == 0 && strcmp(val, "disable") == 0)
+      in->flags = GPIOD_LINE_REQUEST_FLAG_BIAS_DISABLE;
+    else {
+      cfg_error("bad setting", argv[i]);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int parse_generator(int argc, char **argv)
+{
+  static const char *types[] = { "strobe", "chase", "gate" };
+  struct generator *g;
+  char *name;
+  int type, v, i;
+
+  if (argc < 4) {
+    cfg_error("usage: generator NAME TYPE OUTPUT[,OUTPUT...] [key=value ...], got", argv[0]);
+    return -1;
+  }
+
+  for (type = 0; type < 3; type++)
+    if (strcmp(argv[2], types[type]) == 0)
+      break;
+  if (type == 3) {
+    cfg_error("unknown generator type", argv[2]);
+    return -1;
+  }
+
+  g = generator_add(argv[1], type);
+  if (!g)
+    return -1;
+
+  for (name = strtok(argv[3], ","); name; name = strtok(NULL, ",")) {
+    int out = output_find(name);
+    if (out < 0) {
+      cfg_error("unknown output", name);
+      return -1;
+    }
+    if (g->nouts == MAX_GEN_OUTS) {
+      cfg_error("too many outputs in generator", argv[1]);
+      return -1;
+    }
+    g->outs[g->nouts++] = out;
+  }
+  if (g->nouts == 0) {
+    cfg_error("no outputs in generator", argv[1]);
+    return -1;
+  }
+
+  for (i = 4; i < argc; i++) {
+    char *val = strchr(argv[i], '=');
+    if (!val) {
+      cfg_error("expected key=value, got", argv[i]);
+      return -1;
+    }
+    *val++ = '\0';
+
+    if (strcmp(argv[i], "every") == 0 && parse_int(val, 1, 24 * 64, &v) == 0)
+      g->every = v;
+    else if (strcmp(argv[i], "width") == 0 && parse_int(val, 1, 60000, &v) == 0)
+      g->width = v;
+    else if (strcmp(argv[i], "duty") == 0 && parse_int(val, 1, 99, &v) == 0)
+      g->duty = v;
+    else {
+      cfg_error("bad setting", argv[i]);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int parse_cue(int argc, char **argv)
+{
+  struct cue *c;
+  uint32_t time;
+  int out, ms;
+
+  if (argc != 4) {
+    cfg_error("usage: cue HH:MM:SS:FF OUTPUT on|off|pulse=MS, got", argv[0]);
+    return -1;
+  }
+
+  if (smpte_parse(argv[1], &time) < 0) {
+    cfg_error("bad time code", argv[1]);
+    return -1;
+  }
+
+  out = output_find(argv[2]);
+  if (out < 0) {
+    cfg_error("unknown output", argv[2]);
+    return -1;
+  }
+
+  c = cue_add(time, out);
+  if (!c)
+    return -1;
+
+  if (strcmp(argv[3], "on") == 0)
+    c->action = CUE_ON;
+  else if (strcmp(argv[3], "off") == 0)
+    c->action = CUE_OFF;
+  else if (strncmp(argv[3], "pulse=", 6) == 0 && parse_int(argv[3] + 6, 1, 60000, &ms) == 0) {
+    c->action = CUE_PULSE;
+    c->width = ms;
+  }
+  else {
+    cfg_error("bad cue action", argv[3]);
+    return -1;
+  }
+
+  return 0;
+}
+
+static struct pattern *cur_pattern;	// pattern that `step` lines add to
+
+/*
+ * Check the pattern that is complete: one that loops while its note is
+ * held must take time, or it would run its steps forever at once.
+ */
+
+static int pattern_end(void)
+{
+  unsigned int total = 0;
+  int i;
+
+  if (!cur_pattern || cur_pattern->repeat || cur_pattern->nsteps == 0)
+    return 0;
+
+  for (i = 0; i < cur_pattern->nsteps; i++)
+    total += pattern_steps[cur_pattern->first + i].delay;
+  if (total == 0) {
+    cfg_error("no delay in repeating pattern", cur_pattern->name);
+    return -1;
+  }
+  return 0;
+}
+
+static int parse_pattern(int argc, char **argv)
+{
+  int v, i;
+
+  if (pattern_end() < 0)
+    return -1;
+
+  if (argc < 2) {
+    cfg_error("usage: pattern NAME [repeat=N], got", argv[0]);
+    return -1;
+  }
+
+  cur_pattern = pattern_add(argv[1]);
+  if (!cur_pattern)
+    return -1;
+
+  for (i = 2; i < argc; i++) {
+    if (strncmp(argv[i], "repeat=", 7) == 0 && parse_int(argv[i] + 7, 0, 100000, &v) == 0)
+      cur_pattern->repeat = v;
+    else {
+      cfg_error("bad setting", argv[i]);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int parse_step(int argc, char **argv)
+{
+  struct pattern_step *st;
+  int delay, out, i;
+
+  if (!cur_pattern || &patterns[npatterns - 1] != cur_pattern) {
+    cfg_error("step outside of a pattern:", argv[0]);
+    return -1;
+  }
+
+  if (argc < 2 || parse_int(argv[1], 0, 3600000, &delay) < 0) {
+    cfg_error("usage: step DELAY [+OUTPUT ...] [-OUTPUT ...], got", argc < 2 ? argv[0] : argv[1]);
+    return -1;
+  }
+
+  st = pattern_add_step(cur_pattern, delay);
+  if (!st)
+    return -1;
+
+  for (i = 2; i < argc; i++) {
+    if (argv[i][0] != '+' && argv[i][0] != '-') {
+      cfg_error("expected +OUTPUT or -OUTPUT, got", argv[i]);
+      return -1;
+    }
+    out = output_find(argv[i] + 1);
+    if (out < 0) {
+      cfg_error("unknown output", argv[i] + 1);
+      return -1;
+    }
+    if (argv[i][0] == '+') {
+      outset_set(&st->set, out);
+      outset_set(&cur_pattern->touched, out);
+    }
+    else
+      outset_set(&st->clear, out);
+  }
+
+  return 0;
+}
+
+/*
+ * Read the configuration file at `path`.  Returns 0 on success, -1 after
+ * printing a message on the first error.
+ */
+
+int config_load(const char *path)
+{
+  FILE *fp;
+  char line[512];
+  char *argv[MAX_ARGS];
+  int argc, err = 0;
+
+  fp = fopen(path, "r");
+  if (!fp) {
+    perror(path);
+    return -1;
+  }
+
+  cfg_path = path;
+  cfg_lineno = 0;
+
+  while (!err && fgets(line, sizeof(line), fp)) {
+    cfg_lineno++;
+    argc = split(line, argv);
+    if (argc == 0)
+      continue;
+
+    if (strcmp(argv[0], "chip") == 0)
+      err = parse_chip(argc, argv);
+    else if (strcmp(argv[0], "output") == 0)
+      err = parse_output(argc, argv);
+    else if (strcmp(argv[0], "note") == 0)
+      err = parse_note(argc, argv);
+    else if (strcmp(argv[0], "cc") == 0)
+      err = parse_cc(argc, argv);
+    else if (strcmp(argv[0], "input") == 0)
+      err = parse_input(argc, argv);
+    else if (strcmp(argv[0], "generator") == 0)
+      err = parse_generator(argc, argv);
+    else if (strcmp(argv[0], "cue") == 0)
+      err = parse_cue(argc, argv);
+    else if (strcmp(argv[0], "pattern") == 0)
+      err = parse_pattern(argc, argv);
+    else if (strcmp(argv[0], "step") == 0)
+      err = parse_step(argc, argv);
+    else {
+      cfg_error("unknown keyword", argv[0]);
+      err = -1;
+    }
+  }
+
+  if (!err)
+    err = pattern_end();
+
+  fclose(fp);
+  cues_sort();
+  return err;
+}
+
+/*
+ * The original fixed configuration: middle-C, D and E drive lines
+ * 25, 26 and 27 of gpiochip0.
+ */
+
+void config_defaults(void)
+{
+  static const struct { char *name; int line; int note; } defaults[] = {
+    { "line1", 25, 60 },	// middle-C
+    { "line2", 26, 62 },
+    { "line3", 27, 64 },
+  };
+  int i;
+
+  for (i = 0; i < 3; i++)
+    mapping_add(defaults[i].note, output_add(defaults[i].name, "gpiochip0", defaults[i].line));
+}
@@ -0,0 +1,212 @@
+/*
+ * MIDI2GPIOD
+ *
+ * Control socket.
+ *
+ * With `--socket PATH` the program listens on a Unix datagram socket
+ * for requests from midi2gpioctl or any other local client.  A request
+ * is one datagram holding one command line; the reply is one datagram,
+ * the output of the command followed by a last line "ok" or
+ * "error MESSAGE".
+ *
+ *   list		the mappings, one per line
+ *   state		every output: name, chip, line, on/off, forced
+ *   force NAME on|off	hold an output at a value whatever MIDI says
+ *   release NAME|all	let MIDI drive the output again
+ *   panic		all outputs off, as for All Notes Off
+ *   stats		the counters, as printed at exit
+ *
+ * The socket is non-blocking and watched by the main loop with the
+ * sequencer, so a request is served between two batches of events and
+ * a client that does not read its reply loses it instead of stalling
+ * the loop.
+ *
+ * McLaren Labs
+ * 2021
+ *
+ */
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "midi2gpiod.h"
+
+char *control_path = NULL;
+
+unsigned long stat_control_requests;
+
+static int control_fd = -1;
+
+int control_open(const char *path)
+{
+  struct sockaddr_un addr;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "%s: socket path too long\n", path);
+    return -1;
+  }
+
+  control_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (control_fd < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+
+  if (bind(control_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    perror(path);
+    close(control_fd);
+    control_fd = -1;
+    return -1;
+  }
+
+  return 0;
+}
+
+void control_close(void)
+{
+  if (control_fd < 0)
+    return;
+  close(control_fd);
+  unlink(control_path);
+  control_fd = -1;
+}
+
+int control_poll_descriptor(struct pollfd *pfd)
+{
+  pfd->fd = control_fd;
+  pfd->events = POLLIN;
+  pfd->revents = 0;
+  return 1;
+}
+
+static void control_list(FILE *fp)
+{
+  static const char *modes[] = { "hold", "pulse", "pattern", "level" };
+  int i;
+
+  for (i = 0; i < nmappings; i++) {
+    const struct mapping *m = &mappings[i];
+
+    fprintf(fp, "%s %d %s %s", m->mode == MAP_LEVEL ? "cc" : "note", m->note,
+	    m->mode == MAP_PATTERN ? m->pattern->name : outputs[m->out].name,
+	    modes[m->mode]);
+    if (m->channel >= 0)
+      fprintf(fp, " channel=%d", m->channel + 1);
+    if (m->mode == MAP_PULSE)
+      fprintf(fp, " pulse=%u-%u", m->width_min, m->width_max);
+    if (m->maxhold)
+      fprintf(fp, " maxhold=%u", m->maxhold);
+    if (m->active)
+      fprintf(fp, " active");
+    fprintf(fp, "\n");
+  }
+}
+
+static void control_state(FILE *fp)
+{
+  int o;
+
+  for (o = 0; o < noutputs; o++)
+    fprintf(fp, "%s %s %u %s%s\n", outputs[o].name, chips[outputs[o].chip].name,
+	    outputs[o].offset, output_value(o) ? "on" : "off",
+	    outset_test(&out_forced, o) ? " forced" : "");
+}
+
+/*
+ * Run one command.  Returns NULL, or the error message.
+ */
+
+static const char *control_command(char *line, FILE *fp)
+{
+  char *argv[4];
+  int argc = 0, o;
+  char *p;
+
+  for (p = strtok(line, " \t\r\n"); p && argc < 4; p = strtok(NULL, " \t\r\n"))
+    argv[argc++] = p;
+
+  if (argc == 0)
+    return "empty request";
+
+  if (strcmp(argv[0], "list") == 0 && argc == 1)
+    control_list(fp);
+  else if (strcmp(argv[0], "state") == 0 && argc == 1)
+    control_state(fp);
+  else if (strcmp(argv[0], "stats") == 0 && argc == 1)
+    print_stats(fp);
+  else if (strcmp(argv[0], "panic") == 0 && argc == 1)
+    panic("control socket");
+  else if (strcmp(argv[0], "force") == 0 && argc == 3) {
+    o = output_find(argv[1]);
+    if (o < 0)
+      return "unknown output";
+    if (strcmp(argv[2], "on") != 0 && strcmp(argv[2], "off") != 0)
+      return "expected on or off";
+    output_force(o, strcmp(argv[2], "on") == 0);
+  }
+  else if (strcmp(argv[0], "release") == 0 && argc == 2) {
+    if (strcmp(argv[1], "all") == 0) {
+      for (o = 0; o < noutputs; o++)
+	output_unforce(o);
+      return NULL;
+    }
+    o = output_find(argv[1]);
+    if (o < 0)
+      return "unknown output";
+    output_unforce(o);
+  }
+  else
+    return "unknown command";
+
+  return NULL;
+}
+
+/*
+ * Serve the requests waiting on the socket.
+ */
+
+void control_handle(const struct pollfd *pfd)
+{
+  static char req[256], reply[CONTROL_REPLY_MAX];
+  struct sockaddr_un from;
+  socklen_t fromlen;
+  const char *err;
+  ssize_t len;
+  FILE *fp;
+
+  if (control_fd < 0 || !(pfd->revents & POLLIN))
+    return;
+
+  for (;;) {
+    fromlen = sizeof(from);
+    len = recvfrom(control_fd, req, sizeof(req) - 1, 0,
+		   (struct sockaddr *) &from, &fromlen);
+    if (len < 0) {
+      if (errno != EAGAIN)
+	perror("control");
+      return;
+    }
+    req[len] = '\0';
+    stat_control_requests++;
+
+    fp = fmemopen(reply, sizeof(reply), "w");
+    if (!fp)
+      return;
+    err = control_command(req, fp);
+    if (err)
+      fprintf(fp, "error %s\n", err);
+    else
+      fprintf(fp, "ok\n");
+    len = ftell(fp);
+    fclose(fp);
+
+    // the client may be gone, or not reading; never wait for it
+    if (fromlen > sizeof(sa_family_t))
+      sendto(control_fd, reply, len, MSG_DONTWAIT, (struct sockaddr *) &from, fromlen);
+  }
+}
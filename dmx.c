@@ -0,0 +1,297 @@
+/*
+ * MIDI2GPIOD
+ *
+ * DMX over Ethernet backends, Art-Net and sACN (E1.31).
+ *
+ * A DMX universe is declared as a chip, and its outputs are DMX
+ * channels.  The outputs take part in the mappings like any other:
+ * a note turns a channel on at its level (full by default), and a `cc`
+ * mapping sets the level of a channel from the controller value.  A
+ * commit that changes a universe sends one UDP packet with the whole
+ * universe, so all the channels changed by a batch of events arrive
+ * together.  Receivers expect a universe to be refreshed even when
+ * nothing changes; every `refresh` ms (default 1000) the universe is
+ * sent again.
+ *
+ *   chip stage artnet 192.168.1.50 universe=0
+ *   chip wash  sacn universe=1		# multicast 239.255.0.1
+ *   output spot1 stage 1		# DMX channel 1
+ *
+ * Without an address Art-Net is broadcast and sACN sent to the
+ * multicast group of the universe.  With 127.0.0.1 a local receiver
+ * can check the packets.
+ *
+ * McLaren Labs
+ * 2021
+ *
+ */
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "midi2gpiod.h"
+
+#define DMX_CHANNELS	512
+#define ARTNET_PORT	6454
+#define ARTNET_HEADER	18
+#define SACN_PORT	5568
+#define SACN_HEADER	126
+
+struct dmx {
+  struct out_chip	*chip;
+  int			sacn;		// 0 for Art-Net
+  int			fd;
+  struct sockaddr_in	dest;
+  int			port;
+  int			universe;
+  unsigned int		refresh;	// ms
+  struct timer		refresh_timer;
+  int			nchannels;	// sent in every packet, even
+  unsigned char		seq;
+  unsigned char		packet[SACN_HEADER + DMX_CHANNELS];
+};
+
+static void dmx_refresh_expired(struct timer *t);
+
+static struct dmx *dmx_priv(struct out_chip *ch)
+{
+  if (!ch->priv) {
+    struct dmx *d = calloc(1, sizeof(*d));
+    if (!d)
+      return NULL;
+    d->chip = ch;
+    d->sacn = ch->ops == &sacn_ops;
+    d->fd = -1;
+    d->port = d->sacn ? SACN_PORT : ARTNET_PORT;
+    d->universe = d->sacn ? 1 : 0;
+    d->refresh = 1000;
+    timer_init(&d->refresh_timer, dmx_refresh_expired);
+    ch->priv = d;
+  }
+  return ch->priv;
+}
+
+static int dmx_setting(struct out_chip *ch, const char *key, const char *val)
+{
+  struct dmx *d = dmx_priv(ch);
+  char *end;
+  long v;
+
+  if (!d)
+    return -1;
+
+  v = strtol(val, &end, 0);
+  if (*val == '\0' || *end != '\0')
+    return -1;
+
+  if (strcmp(key, "universe") == 0 && v >= (d->sacn ? 1 : 0) && v <= (d->sacn ? 63999 : 32767))
+    d->universe = v;
+  else if (strcmp(key, "refresh") == 0 && v >= 10 && v <= 60000)
+    d->refresh = v;
+  else if (strcmp(key, "port") == 0 && v >= 1 && v <= 65535)
+    d->port = v;
+  else
+    return -1;
+  return 0;
+}
+
+static void put16(unsigned char *p, unsigned int v)
+{
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+/*
+ * Fill in the parts of the packet that never change.
+ */
+
+static void artnet_header(struct dmx *d)
+{
+  unsigned char *p = d->packet;
+
+  memcpy(p, "Art-Net", 8);
+  p[8] = 0x00;			// OpDmx, little endian
+  p[9] = 0x50;
+  put16(p + 10, 14);		// protocol version
+  p[14] = d->universe & 0xff;	// SubUni
+  p[15] = d->universe >> 8;	// Net
+  put16(p + 16, d->nchannels);
+}
+
+static void sacn_header(struct dmx *d)
+{
+  static const unsigned char acn_id[12] = "ASC-E1.17\0\0";
+  unsigned char *p = d->packet;
+  int len = SACN_HEADER + d->nchannels;
+  uint32_t h = 2166136261u;
+  const char *s;
+  int i;
+
+  // root layer
+  put16(p, 0x0010);
+  put16(p + 2, 0);
+  memcpy(p + 4, acn_id, 12);
+  put16(p + 16, 0x7000 | (len - 16));
+  put16(p + 18, 0);
+  put16(p + 20, 0x0004);
+
+  // a component id that stays the same from one run to the next
+  for (s = d->chip->name; *s; s++)
+    h = (h ^ (unsigned char) *s) * 16777619u;
+  for (i = 0; i < 16; i++) {
+    h = (h ^ i) * 16777619u;
+    p[22 + i] = h >> 24;
+  }
+
+  // framing layer
+  put16(p + 38, 0x7000 | (len - 38));
+  put16(p + 40, 0);
+  put16(p + 42, 0x0002);
+  snprintf((char *) p + 44, 64, "%s %s", GPIOD_CONSUMER, d->chip->name);
+  p[108] = 100;			// priority
+  put16(p + 109, 0);		// no synchronization
+  p[111] = 0;			// sequence, per packet
+  p[112] = 0;			// options
+  put16(p + 113, d->universe);
+
+  // DMP layer
+  put16(p + 115, 0x7000 | (len - 115));
+  p[117] = 0x02;
+  p[118] = 0xa1;
+  put16(p + 119, 0);
+  put16(p + 121, 1);
+  put16(p + 123, d->nchannels + 1);
+  p[125] = 0;			// DMX start code
+}
+
+static int dmx_write(struct out_chip *ch, const struct outset *state)
+{
+  struct dmx *d = ch->priv;
+  int header = d->sacn ? SACN_HEADER : ARTNET_HEADER;
+  unsigned char *data = d->packet + header;
+  int i;
+
+  memset(data, 0, d->nchannels);
+  for (i = 0; i < ch->nouts; i++) {
+    int o = ch->outs[i];
+    if (outset_test(state, o))
+      data[outputs[o].offset - 1] = ch->level ? ch->level[o] : outputs[o].level;
+  }
+
+  // sequence 0 turns sequencing off in Art-Net
+  if (++d->seq == 0 && !d->sacn)
+    d->seq = 1;
+  d->packet[d->sacn ? 111 : 12] = d->seq;
+
+  if (sendto(d->fd, d->packet, header + d->nchannels, MSG_DONTWAIT,
+	     (struct sockaddr *) &d->dest, sizeof(d->dest)) < 0) {
+    fprintf(stderr, "Send universe '%s' failed: %s\n", ch->name, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * The universe was not sent for a while: mark it for the next commit.
+ */
+
+static void dmx_refresh_expired(struct timer *t)
+{
+  struct dmx *d = container_of(t, struct dmx, refresh_timer);
+
+  if (d->chip->nouts)
+    outset_set(&out_dirty, d->chip->outs[0]);
+  timer_add(&d->refresh_timer, d->refresh);
+}
+
+/*
+ * Open the socket and send the initial state of the universe.  Returns
+ * 1 on success.
+ */
+
+static int dmx_open(struct out_chip *ch)
+{
+  struct dmx *d = dmx_priv(ch);
+  int i, one = 1;
+
+  if (!d) {
+    perror("dmx");
+    return 0;
+  }
+
+  d->nchannels = 0;
+  for (i = 0; i < ch->nouts; i++) {
+    int c = outputs[ch->outs[i]].offset;
+    if (c < 1 || c > DMX_CHANNELS) {
+      fprintf(stderr, "Universe '%s' has no channel %d\n", ch->name, c);
+      return 0;
+    }
+    if (c > d->nchannels)
+      d->nchannels = c;
+  }
+  d->nchannels += d->nchannels & 1;
+
+  memset(&d->dest, 0, sizeof(d->dest));
+  d->dest.sin_family = AF_INET;
+  d->dest.sin_port = htons(d->port);
+  if (ch->path) {
+    if (inet_pton(AF_INET, ch->path, &d->dest.sin_addr) != 1) {
+      fprintf(stderr, "Universe '%s': bad address '%s'\n", ch->name, ch->path);
+      return 0;
+    }
+  }
+  else if (d->sacn)
+    d->dest.sin_addr.s_addr = htonl(0xefff0000 | d->universe);	// 239.255.hi.lo
+  else
+    d->dest.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+
+  d->fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (d->fd < 0) {
+    perror("socket");
+    return 0;
+  }
+  if (!ch->path && !d->sacn)
+    setsockopt(d->fd, SOL_SOCKET, SO_BROADCAST, &one, sizeof(one));
+
+  if (d->sacn)
+    sacn_header(d);
+  else
+    artnet_header(d);
+
+  dmx_write(ch, &out_state);
+  timer_add(&d->refresh_timer, d->refresh);
+  return 1;
+}
+
+/*
+ * Close the socket.  The settings stay, for when the universe is opened
+ * again.
+ */
+
+static void dmx_close(struct out_chip *ch)
+{
+  struct dmx *d = ch->priv;
+
+  timer_del(&d->refresh_timer);
+  close(d->fd);
+  d->fd = -1;
+}
+
+const struct chip_ops artnet_ops = {
+  .type		= "artnet",
+  .max_lines	= MAX_OUTPUTS,
+  .setting	= dmx_setting,
+  .open		= dmx_open,
+  .write	= dmx_write,
+  .close	= dmx_close,
+};
+
+const struct chip_ops sacn_ops = {
+  .type		= "sacn",
+  .max_lines	= MAX_OUTPUTS,
+  .setting	= dmx_setting,
+  .open		= dmx_open,
+  .write	= dmx_write,
+  .close	= dmx_close,
+};
@@ -0,0 +1,115 @@
+/*
+ * MIDI2GPIOD
+ *
+ * Pin-state feedback.
+ *
+ * With `--feedback` every output that changes level is reported back
+ * to the source, so that a control surface can light its buttons from
+ * what actually switched rather than from what it sent.  An output is
+ * reported with the note of the first mapping that drives it, on that
+ * mapping's channel: Note-On velocity 127 when it goes on, Note-Off
+ * when it goes off.  An output driven by a controller is reported as
+ * that controller, 127 or 0.  With `--feedback=cc` every output is a
+ * controller of the same number.  Outputs no mapping drives are not
+ * reported.
+ *
+ * The report is made from the outputs that changed level in a commit,
+ * so the feedback rate follows the real changes and not the incoming
+ * traffic: a note that is already on sends nothing.  The events go out
+ * with the rest of the batch, in one drain.  They are sent to the source
+ * port directly, or to our subscribers when no source is connected.
+ *
+ * McLaren Labs
+ * 2021
+ *
+ */
+
+#include "midi2gpiod.h"
+
+int feedback_mode = FEEDBACK_OFF;
+
+unsigned long stat_feedback_events;
+
+static signed char fb_number[MAX_OUTPUTS];	// note or controller, -1 for none
+static unsigned char fb_channel[MAX_OUTPUTS];
+static unsigned char fb_cc[MAX_OUTPUTS];	// driven by a controller
+
+int feedback_parse(const char *s)
+{
+  if (!s || strcmp(s, "note") == 0)
+    feedback_mode = FEEDBACK_NOTE;
+  else if (strcmp(s, "cc") == 0)
+    feedback_mode = FEEDBACK_CC;
+  else {
+    fprintf(stderr, "Unknown feedback mode '%s'\n", s);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Find the number of every output, once the mappings are loaded.
+ */
+
+void feedback_init(void)
+{
+  int i, o;
+
+  memset(fb_number, -1, sizeof(fb_number));
+
+  for (i = nmappings - 1; i >= 0; i--) {
+    const struct mapping *m = &mappings[i];
+
+    if (m->out < 0)
+      continue;
+    fb_number[m->out] = m->note;
+    fb_channel[m->out] = m->channel < 0 ? 0 : m->channel;
+    fb_cc[m->out] = m->mode == MAP_LEVEL;
+  }
+
+  if (verbose)
+    for (o = 0; o < noutputs; o++)
+      if (fb_number[o] < 0)
+	printf("Output %s is not mapped, no feedback for it\n", outputs[o].name);
+}
+
+/*
+ * A commit wrote `state`, and the outputs in `changed` changed level.
+ */
+
+void feedback_commit(const struct outset *state, const struct outset *changed)
+{
+  snd_seq_event_t ev;
+  int source, port, connected;
+  int i, o, on;
+
+  connected = source_get(&source, &port);
+
+  for (i = 0; i < OUTSET_WORDS; i++) {
+    uint64_t w = changed->w[i];
+
+    while (w) {
+      o = i * 64 + __builtin_ctzll(w);
+      w &= w - 1;
+      if (fb_number[o] < 0)
+	continue;
+
+      on = outset_test(state, o);
+      snd_seq_ev_clear(&ev);
+      if (feedback_mode == FEEDBACK_CC || fb_cc[o])
+	snd_seq_ev_set_controller(&ev, fb_channel[o], fb_number[o], on ? 127 : 0);
+      else if (on)
+	snd_seq_ev_set_noteon(&ev, fb_channel[o], fb_number[o], 127);
+      else
+	snd_seq_ev_set_noteoff(&ev, fb_channel[o], fb_number[o], 0);
+
+      if (connected)
+	snd_seq_ev_set_dest(&ev, source, port);
+      else
+	snd_seq_ev_set_subs(&ev);
+
+      if (seq_output(&ev) == 0)
+	stat_feedback_events++;
+    }
+  }
+}
@@ -0,0 +1,212 @@
+/*
+ * MIDI2GPIOD
+ *
+ * I2C expander backend, for MCP23017 and PCA9555 16-bit expanders.
+ *
+ * Through the kernel gpio driver every line of an expander costs a
+ * read-modify-write of its register on the bus.  Here the program owns
+ * the chip through i2c-dev instead: the output latches are kept in
+ * memory, and a commit that changes them writes both ports in a single
+ * SMBus word write, the register address followed by the two latch
+ * bytes.  A chord on sixteen relays is one transaction.
+ *
+ *   chip exp1 mcp23017 /dev/i2c-1 address=0x20
+ *   output relay1 exp1 0		# GPA0
+ *   output relay9 exp1 8		# GPB0
+ *
+ * Lines 0-7 are port A (port 0), lines 8-15 port B (port 1).  The lines
+ * with no output are left as inputs.  Only SMBus transfers are used, so
+ * the i2c-stub module can stand in for the chip.
+ *
+ * McLaren Labs
+ * 2021
+ *
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include "midi2gpiod.h"
+
+#define I2CEXP_LINES	16
+
+struct i2cexp_model {
+  unsigned char	dir;		// direction registers, 1 = input
+  unsigned char	latch;		// output latch registers
+};
+
+static const struct i2cexp_model mcp23017 = { 0x00, 0x14 };	// IODIRA, OLATA (BANK=0)
+static const struct i2cexp_model pca9555 = { 0x06, 0x02 };	// config 0, output 0
+
+struct i2cexp {
+  const struct i2cexp_model *model;
+  int		fd;
+  int		address;
+  uint16_t	bit[MAX_OUTPUTS];	// of every output on the chip
+  uint16_t	latch;			// what the chip has
+  int		valid;
+};
+
+static struct i2cexp *i2cexp_priv(struct out_chip *ch)
+{
+  if (!ch->priv) {
+    struct i2cexp *e = calloc(1, sizeof(*e));
+    if (!e)
+      return NULL;
+    e->fd = -1;
+    e->address = 0x20;
+    e->model = ch->ops == &pca9555_ops ? &pca9555 : &mcp23017;
+    ch->priv = e;
+  }
+  return ch->priv;
+}
+
+static int i2cexp_setting(struct out_chip *ch, const char *key, const char *val)
+{
+  struct i2cexp *e = i2cexp_priv(ch);
+  char *end;
+  long v;
+
+  if (!e)
+    return -1;
+
+  v = strtol(val, &end, 0);
+  if (strcmp(key, "address") == 0 && *val && *end == '\0' && v >= 0x03 && v <= 0x77) {
+    e->address = v;
+    return 0;
+  }
+  return -1;
+}
+
+/*
+ * Write a 16-bit value to a register pair in one transaction.
+ */
+
+static int i2cexp_write_word(struct i2cexp *e, unsigned char reg, uint16_t value)
+{
+  union i2c_smbus_data data;
+  struct i2c_smbus_ioctl_data args;
+
+  data.word = value;		// low byte to `reg`, high byte to `reg` + 1
+  args.read_write = I2C_SMBUS_WRITE;
+  args.command = reg;
+  args.size = I2C_SMBUS_WORD_DATA;
+  args.data = &data;
+  return ioctl(e->fd, I2C_SMBUS, &args);
+}
+
+static int i2cexp_write(struct out_chip *ch, const struct outset *state)
+{
+  struct i2cexp *e = ch->priv;
+  uint16_t latch = 0;
+  int i;
+
+  for (i = 0; i < ch->nouts; i++)
+    if (outset_test(state, ch->outs[i]))
+      latch |= e->bit[i];
+
+  if (e->valid && latch == e->latch)
+    return 0;
+
+  if (i2cexp_write_word(e, e->model->latch, latch) < 0) {
+    fprintf(stderr, "Write chip '%s' failed: %s\n", ch->name, strerror(errno));
+    e->valid = 0;
+    return -1;
+  }
+
+  e->latch = latch;
+  e->valid = 1;
+  return 0;
+}
+
+/*
+ * Open the bus, clear the latches, and make the output lines outputs.
+ * Returns 1 on success.
+ */
+
+static int i2cexp_open(struct out_chip *ch)
+{
+  struct i2cexp *e = i2cexp_priv(ch);
+  uint16_t dir = 0xffff;
+  int i;
+
+  if (!e) {
+    perror("i2c");
+    return 0;
+  }
+
+  if (!ch->path) {
+    fprintf(stderr, "Chip '%s' needs a device\n", ch->name);
+    return 0;
+  }
+
+  for (i = 0; i < ch->nouts; i++) {
+    unsigned int line = outputs[ch->outs[i]].offset;
+    if (line >= I2CEXP_LINES) {
+      fprintf(stderr, "Chip '%s' has no line %u\n", ch->name, line);
+      return 0;
+    }
+    e->bit[i] = 1 << line;
+    dir &= ~e->bit[i];
+  }
+
+  e->fd = open(ch->path, O_RDWR | O_CLOEXEC);
+  if (e->fd < 0) {
+    fprintf(stderr, "Open chip '%s' (%s) failed: %s\n", ch->name, ch->path, strerror(errno));
+    return 0;
+  }
+
+  if (ioctl(e->fd, I2C_SLAVE, e->address) < 0) {
+    fprintf(stderr, "Chip '%s': address 0x%02x: %s\n", ch->name, e->address, strerror(errno));
+    goto fail;
+  }
+
+  // latches first, so the lines come up with their initial values
+  e->valid = 0;
+  if (i2cexp_write(ch, &out_state) < 0)
+    goto fail;
+
+  if (i2cexp_write_word(e, e->model->dir, dir) < 0) {
+    fprintf(stderr, "Configure chip '%s' failed: %s\n", ch->name, strerror(errno));
+    goto fail;
+  }
+
+  return 1;
+
+ fail:
+  close(e->fd);
+  e->fd = -1;
+  return 0;
+}
+
+/*
+ * Close the bus.  The settings stay, for when the chip is opened again.
+ */
+
+static void i2cexp_close(struct out_chip *ch)
+{
+  struct i2cexp *e = ch->priv;
+
+  close(e->fd);
+  e->fd = -1;
+}
+
+const struct chip_ops mcp23017_ops = {
+  .type		= "mcp23017",
+  .max_lines	= I2CEXP_LINES,
+  .setting	= i2cexp_setting,
+  .open		= i2cexp_open,
+  .write	= i2cexp_write,
+  .close	= i2cexp_close,
+};
+
+const struct chip_ops pca9555_ops = {
+  .type		= "pca9555",
+  .max_lines	= I2CEXP_LINES,
+  .setting	= i2cexp_setting,
+  .open		= i2cexp_open,
+  .write	= i2cexp_write,
+  .close	= i2cexp_close,
+};
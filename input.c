@@ -0,0 +1,382 @@
+/*
+ * MIDI2GPIOD
+ *
+ * Input lines.  Each input is requested for events on both edges, and
+ * its event file descriptor is watched by the main loop.  A rising edge
+ * is sent as a Note-On and a falling edge as a Note-Off on our seq port,
+ * so that buttons and sensors wired to the Pi can play remote synths.
+ *
+ * Events are sent with snd_seq_event_output_direct(), bypassing the
+ * output buffer and the queues.  The kernel timestamp of the edge is
+ * used to measure the latency from the edge to the event leaving.
+ *
+ * Inputs wired to mechanical switches can be debounced.  If the kernel
+ * supports a debounce period on the line (GPIO uAPI v2), the line is
+ * requested directly with that attribute and the kernel filters the
+ * bounces.  Otherwise the line is requested through libgpiod and
+ * filtered here: the first edge is reported at once, and edges during
+ * the following debounce period only update the level, which is
+ * reported when the period ends if it differs from the one last sent.
+ *
+ * McLaren Labs
+ * 2021
+ *
+ */
+
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+#include "midi2gpiod.h"
+
+struct input inputs[MAX_INPUTS];
+int ninputs;
+
+unsigned long stat_input_edges;		// edges read from the kernel
+unsigned long stat_input_events;	// MIDI events sent for them
+uint64_t stat_input_latency_max;	// ns from edge to event sent
+uint64_t stat_input_latency_sum;
+unsigned long stat_input_latency_n;	// events in the sum
+unsigned long stat_input_filtered;	// edges dropped by the software debounce
+
+struct input_chip {
+  char			*name;
+  struct gpiod_chip	*chip;
+};
+
+static struct input_chip in_chips[MAX_CHIPS];
+static int nin_chips;
+
+static void debounce_expired(struct timer *t);
+
+/*
+ * Declare an input line.  Returns the new input, or NULL.
+ */
+
+struct input *input_add(const char *name, const char *chipname, unsigned int offset)
+{
+  struct input *in;
+
+  if (ninputs == MAX_INPUTS) {
+    fprintf(stderr, "Too many inputs (max %d)\n", MAX_INPUTS);
+    return NULL;
+  }
+
+  in = &inputs[ninputs++];
+  in->name = strdup(name);
+  in->chipname = strdup(chipname);
+  in->offset = offset;
+  in->channel = 0;
+  in->note = 60;
+  in->velocity = 100;
+  in->invert = 0;
+  in->flags = 0;
+  in->debounce = 0;
+  in->line = NULL;
+  in->fd = -1;
+  in->kernel_debounce = 0;
+  in->level = 0;
+  in->reported = 0;
+  timer_init(&in->debounce_timer, debounce_expired);
+  return in;
+}
+
+static struct gpiod_chip *input_chip_open(const char *name)
+{
+  int i;
+
+  for (i = 0; i < nin_chips; i++)
+    if (strcmp(in_chips[i].name, name) == 0)
+      return in_chips[i].chip;
+
+  if (nin_chips == MAX_CHIPS) {
+    fprintf(stderr, "Too many input chips (max %d)\n", MAX_CHIPS);
+    return NULL;
+  }
+
+  in_chips[nin_chips].chip = gpiod_chip_open_lookup(name);
+  if (!in_chips[nin_chips].chip) {
+    fprintf(stderr, "Open chip '%s' failed: %s\n", name, strerror(errno));
+    return NULL;
+  }
+  in_chips[nin_chips].name = strdup(name);
+  return in_chips[nin_chips++].chip;
+}
+
+/*
+ * Request the line for edge events through the GPIO character device
+ * directly, with the kernel debounce attribute.  Returns the line
+ * request fd, or -1 if the kernel or the driver does not support it.
+ */
+
+static int input_request_debounced(struct input *in)
+{
+  struct gpio_v2_line_request req;
+  char path[64];
+  int chipfd, ret;
+
+  if (in->chipname[0] == '/')
+    snprintf(path, sizeof(path), "%s", in->chipname);
+  else if (in->chipname[0] >= '0' && in->chipname[0] <= '9')
+    snprintf(path, sizeof(path), "/dev/gpiochip%s", in->chipname);
+  else
+    snprintf(path, sizeof(path), "/dev/%s", in->chipname);
+
+  chipfd = open(path, O_RDWR | O_CLOEXEC);
+  if (chipfd < 0)
+    return -1;
+
+  memset(&req, 0, sizeof(req));
+  req.offsets[0] = in->offset;
+  req.num_lines = 1;
+  snprintf(req.consumer, sizeof(req.consumer), "%s", GPIOD_CONSUMER);
+
+  req.config.flags = GPIO_V2_LINE_FLAG_INPUT |
+    GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+  if (in->flags & GPIOD_LINE_REQUEST_FLAG_BIAS_PULL_UP)
+    req.config.flags |= GPIO_V2_LINE_FLAG_BIAS_PULL_UP;
+  if (in->flags & GPIOD_LINE_REQUEST_FLAG_BIAS_PULL_DOWN)
+    req.config.flags |= GPIO_V2_LINE_FLAG_BIAS_PULL_DOWN;
+  if (in->flags & GPIOD_LINE_REQUEST_FLAG_BIAS_DISABLE)
+    req.config.flags |= GPIO_V2_LINE_FLAG_BIAS_DISABLED;
+
+  req.config.num_attrs = 1;
+  req.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_DEBOUNCE;
+  req.config.attrs[0].attr.debounce_period_us = in->debounce * 1000;
+  req.config.attrs[0].mask = 1;
+
+  ret = ioctl(chipfd, GPIO_V2_GET_LINE_IOCTL, &req);
+  close(chipfd);
+  if (ret < 0)
+    return -1;
+
+  return req.fd;
+}
+
+/*
+ * Request every input line for edge events.  Returns 1 on success.
+ */
+
+int input_setup(void)
+{
+  struct gpiod_chip *chip;
+  int i;
+
+  for (i = 0; i < ninputs; i++) {
+    struct input *in = &inputs[i];
+
+    if (in->debounce) {
+      in->fd = input_request_debounced(in);
+      if (in->fd >= 0) {
+	struct gpio_v2_line_values vals = { 0, 1 };
+	if (ioctl(in->fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &vals) == 0)
+	  in->level = in->reported = vals.bits & 1;
+	in->kernel_debounce = 1;
+	continue;
+      }
+      if (verbose)
+	printf("Input %s: no kernel debounce, filtering in software\n", in->name);
+    }
+
+    chip = input_chip_open(in->chipname);
+    if (!chip)
+      return 0;
+
+    in->line = gpiod_chip_get_line(chip, in->offset);
+    if (!in->line) {
+      fprintf(stderr, "Get input line %s:%u failed: %s\n",
+	      in->chipname, in->offset, strerror(errno));
+      return 0;
+    }
+
+    if (gpiod_line_request_both_edges_events_flags(in->line, GPIOD_CONSUMER, in->flags) < 0) {
+      fprintf(stderr, "Request input line %s:%u for events failed: %s\n",
+	      in->chipname, in->offset, strerror(errno));
+      return 0;
+    }
+
+    in->fd = gpiod_line_event_get_fd(in->line);
+
+    // start from the actual level so the first edge is not mistaken
+    // for a bounce
+    in->level = in->reported = gpiod_line_get_value(in->line) > 0;
+  }
+
+  return 1;
+}
+
+/*
+ * Release the input lines, also after input_setup() failed half way,
+ * so that it can be tried again.
+ */
+
+void input_release(void)
+{
+  int i;
+
+  for (i = 0; i < ninputs; i++) {
+    timer_del(&inputs[i].debounce_timer);
+    if (inputs[i].line)
+      gpiod_line_release(inputs[i].line);
+    else if (inputs[i].fd >= 0)
+      close(inputs[i].fd);
+    inputs[i].line = NULL;
+    inputs[i].fd = -1;
+    inputs[i].kernel_debounce = 0;
+  }
+
+  for (i = 0; i < nin_chips; i++) {
+    gpiod_chip_close(in_chips[i].chip);
+    free(in_chips[i].name);
+  }
+  nin_chips = 0;
+}
+
+/*
+ * Fill in one pollfd per input.  Returns the number filled in.
+ */
+
+int input_poll_descriptors(struct pollfd *pfds)
+{
+  int i;
+
+  for (i = 0; i < ninputs; i++) {
+    pfds[i].fd = inputs[i].fd;
+    pfds[i].events = POLLIN;
+    pfds[i].revents = 0;
+  }
+  return ninputs;
+}
+
+static uint64_t timespec_ns(const struct timespec *ts)
+{
+  return (uint64_t) ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+/*
+ * Send the MIDI event for one edge of an input.
+ */
+
+static void input_send(struct input *in, int on, uint64_t edge_ns)
+{
+  snd_seq_event_t ev;
+  uint64_t latency;
+  int err;
+
+  snd_seq_ev_clear(&ev);
+  if (on)
+    snd_seq_ev_set_noteon(&ev, in->channel, in->note, in->velocity);
+  else
+    snd_seq_ev_set_noteoff(&ev, in->channel, in->note, 0);
+  snd_seq_ev_set_source(&ev, seq_port0);
+  snd_seq_ev_set_subs(&ev);
+  snd_seq_ev_set_direct(&ev);
+
+  err = snd_seq_event_output_direct(seq, &ev);
+  if (err < 0) {
+    if (verbose)
+      printf("Input %s: send failed (%s)\n", in->name, snd_strerror(err));
+    return;
+  }
+  stat_input_events++;
+
+  // kernels before 5.7 stamp edges with CLOCK_REALTIME; ignore those
+  latency = now_ns() - edge_ns;
+  if (latency < 1000000000ULL) {
+    stat_input_latency_sum += latency;
+    stat_input_latency_n++;
+    if (latency > stat_input_latency_max)
+      stat_input_latency_max = latency;
+  }
+
+  if (verbose)
+    printf("Input %s: %s note %d (%llu us)\n", in->name, on ? "on" : "off",
+	   in->note, (unsigned long long) latency / 1000);
+}
+
+/*
+ * One edge of an input, with `level` the level of the line after it.
+ * Without software debounce every edge is reported.  With it, the
+ * input is either stable, and the edge is reported at once, or settling
+ * after a reported edge, and the edge only records the new level.
+ */
+
+static void input_edge(struct input *in, int level, uint64_t edge_ns)
+{
+  stat_input_edges++;
+  in->level = level;
+
+  if (in->debounce == 0 || in->kernel_debounce) {
+    in->reported = level;
+    input_send(in, level != in->invert, edge_ns);
+    return;
+  }
+
+  if (timer_pending(&in->debounce_timer) || level == in->reported) {
+    stat_input_filtered++;
+    return;
+  }
+
+  in->reported = level;
+  input_send(in, level != in->invert, edge_ns);
+  timer_add(&in->debounce_timer, in->debounce);
+}
+
+/*
+ * The settling period of an input ended.  If the line bounced to a
+ * different level than the one reported, that is a real transition.
+ */
+
+static void debounce_expired(struct timer *t)
+{
+  struct input *in = container_of(t, struct input, debounce_timer);
+
+  if (in->level == in->reported)
+    return;
+
+  in->reported = in->level;
+  input_send(in, in->level != in->invert, now_ns());
+  timer_add(&in->debounce_timer, in->debounce);
+}
+
+/*
+ * Read the pending edges of every input whose descriptor is readable.
+ */
+
+void input_handle(const struct pollfd *pfds)
+{
+  struct gpiod_line_event events[16];
+  struct gpio_v2_line_event kevents[16];
+  int i, j, n;
+
+  for (i = 0; i < ninputs; i++) {
+    struct input *in = &inputs[i];
+
+    if (!(pfds[i].revents & POLLIN))
+      continue;
+
+    if (in->kernel_debounce) {
+      ssize_t len = read(in->fd, kevents, sizeof(kevents));
+      if (len < 0) {
+	if (errno != EAGAIN)
+	  perror("read line events");
+	continue;
+      }
+      for (j = 0; j < len / (ssize_t) sizeof(kevents[0]); j++)
+	input_edge(in, kevents[j].id == GPIO_V2_LINE_EVENT_RISING_EDGE,
+		   kevents[j].timestamp_ns);
+      continue;
+    }
+
+    n = gpiod_line_event_read_multiple(in->line, events, 16);
+    if (n < 0) {
+      perror("gpiod_line_event_read_multiple");
+      continue;
+    }
+
+    for (j = 0; j < n; j++)
+      input_edge(in, events[j].event_type == GPIOD_LINE_EVENT_RISING_EDGE,
+		 timespec_ns(&events[j].ts));
+  }
+}
@@ -0,0 +1,111 @@
+/*
+ * MIDI2GPIOD
+ *
+ * midi2gpioctl - send a command to a running midi2gpiod through its
+ * control socket, and print the reply.
+ *
+ *   $ midi2gpioctl state
+ *   $ midi2gpioctl force relay1 off
+ *   $ midi2gpioctl -s /run/midi2gpiod.sock stats
+ *
+ * Exits with status 1 if the command failed.
+ *
+ * McLaren Labs
+ * 2021
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define REPLY_MAX	65536
+
+static void help(const char *pgm)
+{
+  printf("Usage: %s [-s socket] list|state|stats|panic|force NAME on|off|release NAME|all\n", pgm);
+}
+
+int main(int argc, char *argv[])
+{
+  static char reply[REPLY_MAX + 1];
+  const char *path = "/run/midi2gpiod.sock";
+  struct sockaddr_un addr, self;
+  char req[256];
+  struct pollfd pfd;
+  ssize_t len;
+  int c, fd, i, n = 0;
+
+  while ((c = getopt(argc, argv, "hs:")) != -1) {
+    switch (c) {
+    case 's':
+      path = optarg;
+      break;
+    case 'h':
+      help(argv[0]);
+      return 0;
+    default:
+      help(argv[0]);
+      return 2;
+    }
+  }
+
+  if (optind == argc) {
+    help(argv[0]);
+    return 2;
+  }
+
+  for (i = optind; i < argc; i++) {
+    int w = snprintf(req + n, sizeof(req) - n, "%s%s", i > optind ? " " : "", argv[i]);
+    if (w < 0 || w >= (int) sizeof(req) - n) {
+      fprintf(stderr, "Command too long\n");
+      return 2;
+    }
+    n += w;
+  }
+
+  fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("socket");
+    return 1;
+  }
+
+  // an address in the abstract namespace, for the reply
+  memset(&self, 0, sizeof(self));
+  self.sun_family = AF_UNIX;
+  if (bind(fd, (struct sockaddr *) &self, sizeof(sa_family_t)) < 0) {
+    perror("bind");
+    return 1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+  if (sendto(fd, req, n, 0, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    perror(path);
+    return 1;
+  }
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, 2000) <= 0) {
+    fprintf(stderr, "%s: no reply\n", path);
+    return 1;
+  }
+
+  len = recv(fd, reply, REPLY_MAX, 0);
+  if (len < 0) {
+    perror("recv");
+    return 1;
+  }
+  reply[len] = '\0';
+  fputs(reply, stdout);
+
+  return strstr(reply, "\nerror ") || strncmp(reply, "error ", 6) == 0;
+}
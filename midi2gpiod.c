@@ -20,6 +20,8 @@
  *
  */
 
+#define _GNU_SOURCE		// ppoll()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
@@ -27,6 +29,7 @@
 #include <sys/poll.h>
 #include <gpiod.h>
 #include <alsa/asoundlib.h>
+#include "midi2gpiod.h"
 
 /*
  * Global Vars for program
@@ -36,21 +39,19 @@ int verbose = 0;
 
 /*
  * Configuration for GPIO pins
+ *
+ * The outputs and the notes that drive them come from the configuration
+ * file given with `-c`, see config.c.  Without one, middle-C, D and E
+ * drive lines 25, 26 and 27 of gpiochip0.
  */
 
-static char *chipname = "gpiochip0";
-static int line1_num = 25;
-static int line2_num = 26;
-static int line3_num = 27;
-
-struct gpiod_chip *chip;
-struct gpiod_line *line1;
-struct gpiod_line *line2;
-struct gpiod_line *line3;
+struct mapping mappings[MAX_MAPPINGS];
+int nmappings;
+struct mapping *note_map[128];	// first mapping of each note
+struct mapping *cc_map[128];	// first mapping of each controller
 
-#ifndef	GPIOD_CONSUMER
-#define	GPIOD_CONSUMER	"midi2gpiod"
-#endif
+unsigned long stat_stuck;	// hold mappings released by their maximum on-time
+unsigned long stat_panics;
 
 
 
@@ -73,6 +74,14 @@ snd_seq_t	*seq;
 int		seq_client;
 int		seq_port0;
 
+/*
+ * The address we are connected from, once the connection succeeded.
+ * If it goes away while notes are held, nothing would release them.
+ * Set at startup, then only by the announce thread.
+ */
+
+int		source_addr = -1;	// client << 8 | port, see source_get()
+
 /*
  * These are the names we give our client and port.  These are the names that
  * appear if you run aconnect like this.
@@ -102,68 +111,96 @@ int  port_caps =  (SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_WRITE |
 int  port_type = SND_SEQ_PORT_TYPE_MIDI_GENERIC;
 
 
-void check_snd_err_fatal(const char *msg, int err) {
-  if (err < 0) {
-    fprintf(stderr, "%s: Alsa error (%s)", msg, snd_strerror(err));
-    exit(1);
-  }
+int check_snd_err(const char *msg, int err) {
+  if (err < 0)
+    fprintf(stderr, "%s: Alsa error (%s)\n", msg, snd_strerror(err));
+  return err;
 }
 
-void open_seq(void)
+int open_seq(void)
 {
   int err;
 
   err = snd_seq_open(&seq, sequencer_type, sequencer_streams, sequencer_mode);
-  check_snd_err_fatal("snd_seq_open", err);
+  if (check_snd_err("snd_seq_open", err) < 0)
+    return err;
 
   err = snd_seq_set_client_name(seq, sequencer_name);
-  check_snd_err_fatal("snd_seq_set_client_name", err);
+  if (check_snd_err("snd_seq_set_client_name", err) < 0)
+    return err;
 
   // get the client id for this sequencer
   seq_client = snd_seq_client_id(seq);
+  return 0;
 }
 
-void create_port(void)
+int create_port(void)
 {
   seq_port0 = snd_seq_create_simple_port(seq, port_name, port_caps, port_type);
-  check_snd_err_fatal("snd_seq_create_simple_port", seq_port0);
+  return check_snd_err("snd_seq_create_simple_port", seq_port0);
 }
 
 /*
- * Attempt to connect from midi port specifed in 'portspec'.
+ * Attempt to connect from midi port specifed in 'portspec', through
+ * the client `handle`, ours or the announce client.
  */
 
-void connect_from_rtpmidi_port(void)
+void connect_from_rtpmidi_port(snd_seq_t *handle)
 {
   int err;
-  snd_seq_addr_t	addr;
+  snd_seq_addr_t	addr, dest;
+  snd_seq_port_subscribe_t *subs;
 
-  err = snd_seq_parse_address(seq, &addr, portspec);
+  err = snd_seq_parse_address(handle, &addr, portspec);
   if (err < 0) {
     printf("Parsing portspec '%s' failed.  Ignoring.\n", portspec);
     printf("Alsa error (%s)\n", snd_strerror(err));
     return;
   }
     
-  err = snd_seq_connect_from(seq, seq_port0, addr.client, addr.port);
+  // any client may connect two ports, as aconnect does
+  dest.client = seq_client;
+  dest.port = seq_port0;
+  snd_seq_port_subscribe_alloca(&subs);
+  snd_seq_port_subscribe_set_sender(subs, &addr);
+  snd_seq_port_subscribe_set_dest(subs, &dest);
+  err = snd_seq_subscribe_port(handle, subs);
   if (err < 0) {
     printf("Connecting from '%s' failed.  Ignoring.\n", portspec);
     printf("Alsa error (%s)\n", snd_strerror(err));
     return;
   }
 
+  source_set(addr.client, addr.port);
   printf("Connection from '%s' succeeded\n", portspec);
 }
 
-void subscribe_to_system_events(void)
+/*
+ * Create our client and port and the announce client, and try to
+ * connect the source.  Announcements queue up on the announce client
+ * from here on, so a source that appears before the announce thread
+ * starts is not missed.  Returns 0, or the ALSA error with nothing
+ * left open.
+ */
+
+int seq_setup(void)
 {
   int err;
-  err = snd_seq_connect_from(seq, seq_port0, SND_SEQ_CLIENT_SYSTEM, SND_SEQ_PORT_SYSTEM_ANNOUNCE);
-  check_snd_err_fatal("snd_seq_connect_from (in subscribe)", err);
+
+  if ((err = open_seq()) < 0 || (err = create_port()) < 0 ||
+      (err = announce_open()) < 0) {
+    if (seq)
+      snd_seq_close(seq);
+    seq = NULL;
+    return err;
+  }
+
+  connect_from_rtpmidi_port(seq);
+  return 0;
 }
 
 
-static void log_event(const snd_seq_event_t *ev)
+void log_event(const snd_seq_event_t *ev)
 {
   printf("%3d:%-3d ", ev->source.client, ev->source.port);
   switch (ev->type) {
@@ -216,25 +253,159 @@ static void log_event(const snd_seq_event_t *ev)
   }
 }
 
+/*
+ * Release a hold mapping and turn its output off when nothing else
+ * keeps it on.
+ */
+
+static void mapping_release(struct mapping *m)
+{
+  struct output *out = &outputs[m->out];
+
+  m->active = 0;
+  timer_del(&m->hold_timer);
+  if (--out->holds == 0 && !timer_pending(&out->pulse_timer))
+    output_set(m->out, 0);
+}
+
+/*
+ * The Note-Off of a hold mapping did not arrive in time.
+ */
+
+static void hold_expired(struct timer *t)
+{
+  struct mapping *m = container_of(t, struct mapping, hold_timer);
+
+  if (!m->active)
+    return;
+
+  stat_stuck++;
+  if (verbose)
+    printf("Stuck note %d released %s after %u ms\n",
+	   m->note, outputs[m->out].name, m->maxhold);
+  mapping_release(m);
+}
+
+/*
+ * Add a mapping from `note` to output `out`, in hold mode on any channel.
+ * A pattern mapping has no output; `out` is -1.
+ */
+
+struct mapping *mapping_add(int note, int out)
+{
+  struct mapping *m, **pp;
+
+  if (nmappings == MAX_MAPPINGS) {
+    fprintf(stderr, "Too many mappings (max %d)\n", MAX_MAPPINGS);
+    return NULL;
+  }
+
+  m = &mappings[nmappings++];
+  m->channel = -1;
+  m->note = note;
+  m->out = out;
+  m->mode = MAP_HOLD;
+  m->pattern = NULL;
+  m->maxhold = 0;
+  m->active = 0;
+  timer_init(&m->hold_timer, hold_expired);
+  m->next = NULL;
+
+  // keep mappings of a note in configuration order
+  for (pp = &note_map[note]; *pp; pp = &(*pp)->next)
+    ;
+  *pp = m;
+  return m;
+}
+
+/*
+ * Add a mapping from controller `cc` to the level of output `out`.
+ */
+
+struct mapping *mapping_add_cc(int cc, int out)
+{
+  struct mapping *m, **pp;
+
+  if (nmappings == MAX_MAPPINGS) {
+    fprintf(stderr, "Too many mappings (max %d)\n", MAX_MAPPINGS);
+    return NULL;
+  }
+
+  m = &mappings[nmappings++];
+  memset(m, 0, sizeof(*m));
+  m->channel = -1;
+  m->note = cc;
+  m->out = out;
+  m->mode = MAP_LEVEL;
+  timer_init(&m->hold_timer, hold_expired);
+
+  for (pp = &cc_map[cc]; *pp; pp = &(*pp)->next)
+    ;
+  *pp = m;
+  return m;
+}
+
+/*
+ * Drop everything that keeps an output on, and turn all the outputs
+ * off in one commit, right away rather than at the end of the batch.
+ */
+
+void panic(const char *why)
+{
+  int i;
+
+  for (i = 0; i < nmappings; i++) {
+    mappings[i].active = 0;
+    timer_del(&mappings[i].hold_timer);
+  }
+  for (i = 0; i < npatterns; i++)
+    pattern_stop(&patterns[i]);
+  clock_stop();
+
+  output_all_off();
+  output_commit_wait();
+  stat_panics++;
+
+  if (verbose)
+    printf("Panic: %s, all outputs off\n", why);
+}
+
+static unsigned int pulse_width(const struct mapping *m, int velocity)
+{
+  return m->width_min + (m->width_max - m->width_min) * (velocity - 1) / 126;
+}
+
 void handle_event_note_on(const snd_seq_event_t *ev)
 {
   int channel = ev->data.note.channel;
   int note = ev->data.note.note;
   int velocity = ev->data.note.velocity;
+  struct mapping *m;
 
   if (verbose)
     printf("Handle note on:%d %d %d\n", channel, note, velocity);
 
-  if (note == 60) {  // middle-C
-    gpiod_line_set_value(line1, 1);
-  }
+  for (m = note_map[note & 0x7f]; m; m = m->next) {
+    if (m->channel >= 0 && m->channel != channel)
+      continue;
 
-  if (note == 62) {
-    gpiod_line_set_value(line2, 1);
-  }
+    if (m->mode == MAP_PULSE) {
+      output_pulse(m->out, pulse_width(m, velocity));
+      continue;
+    }
 
-  if (note == 64) {
-    gpiod_line_set_value(line3, 1);
+    if (m->mode == MAP_PATTERN) {
+      pattern_launch(m->pattern);
+      continue;
+    }
+
+    if (!m->active) {
+      m->active = 1;
+      outputs[m->out].holds++;
+    }
+    if (m->maxhold)
+      timer_add(&m->hold_timer, m->maxhold);
+    output_set(m->out, 1);
   }
 }
 
@@ -243,20 +414,36 @@ void handle_event_note_off(const snd_seq_event_t *ev)
   int channel = ev->data.note.channel;
   int note = ev->data.note.note;
   int velocity = ev->data.note.velocity;
+  struct mapping *m;
 
   if (verbose)
-    printf("Handle note on:%d %d %d\n", channel, note, velocity);
+    printf("Handle note off:%d %d %d\n", channel, note, velocity);
 
-  if (note == 60) {
-    gpiod_line_set_value(line1, 0);
-  }
+  for (m = note_map[note & 0x7f]; m; m = m->next) {
+    if (m->channel >= 0 && m->channel != channel)
+      continue;
 
-  if (note == 62) {
-    gpiod_line_set_value(line2, 0);
+    // a pattern that repeats forever plays while the note is held
+    if (m->mode == MAP_PATTERN && m->pattern->repeat == 0)
+      pattern_stop(m->pattern);
+
+    // pulses end on their own
+    if (m->mode != MAP_HOLD || !m->active)
+      continue;
+
+    mapping_release(m);
   }
+}
+
+void handle_event_controller(const snd_seq_event_t *ev)
+{
+  int channel = ev->data.control.channel;
+  struct mapping *m;
 
-  if (note == 64) {
-    gpiod_line_set_value(line3, 0);
+  for (m = cc_map[ev->data.control.param & 0x7f]; m; m = m->next) {
+    if (m->channel >= 0 && m->channel != channel)
+      continue;
+    output_level(m->out, ev->data.control.value & 0x7f);
   }
 }
 
@@ -266,26 +453,59 @@ void handle_event(const snd_seq_event_t *ev)
   switch (ev->type) {
 
   case SND_SEQ_EVENT_NOTEON:
-    handle_event_note_on(ev);
+    // a Note-On with velocity 0 is a Note-Off
+    if (ev->data.note.velocity)
+      handle_event_note_on(ev);
+    else
+      handle_event_note_off(ev);
     break;
 
   case SND_SEQ_EVENT_NOTEOFF:
     handle_event_note_off(ev);
     break;
 
-  case SND_SEQ_EVENT_CLIENT_START:
-    connect_from_rtpmidi_port();
+  case SND_SEQ_EVENT_CONTROLLER:
+    if (ev->data.control.param == MIDI_CTL_ALL_SOUNDS_OFF ||
+	ev->data.control.param == MIDI_CTL_ALL_NOTES_OFF)
+      panic("all notes off");
+    else
+      handle_event_controller(ev);
     break;
 
-  case SND_SEQ_EVENT_PORT_START:
-    connect_from_rtpmidi_port();
+  case SND_SEQ_EVENT_CLOCK:
+    clock_tick(now_ns());
+    break;
+
+  case SND_SEQ_EVENT_START:
+    clock_start();
+    break;
+
+  case SND_SEQ_EVENT_CONTINUE:
+    clock_continue();
+    break;
+
+  case SND_SEQ_EVENT_STOP:
+    clock_stop();
+    break;
+
+  case SND_SEQ_EVENT_SONGPOS:
+    clock_songpos(ev->data.control.value);
+    break;
+
+  case SND_SEQ_EVENT_QFRAME:
+    mtc_quarter_frame(ev->data.control.value);
+    break;
+
+  case SND_SEQ_EVENT_SYSEX:
+    if (!mtc_sysex(ev->data.ext.ptr, ev->data.ext.len))
+      sysex_bulk_state(ev->data.ext.ptr, ev->data.ext.len);
     break;
   }
 }
 
 void help(const char *pgm)
 {
-  printf("Usage: %s [-h] [-v] [-p portspec]\n", pgm);
+  printf("Usage: %s [-h] [-v] [-p portspec] [-c config] [-P file.mid [-l]] [-r trace [-n events]] [-R trace [-f]] [-w] [-s socket] [-S statefile] [-b ms] [-t[mode]] [-F[mode]]\n", pgm);
   printf("\n");
   printf("Watch specified MIDI client and translate Note-On/Off to GPIO On/Off\n");
   printf("\n");
@@ -293,11 +513,71 @@ void help(const char *pgm)
   printf("  -h, --help\t\tdisplay this message and exit\n");
   printf("  -v, --verbose\t\tlog relevant MIDI messages\n");
   printf("  -p, --portspec=client:port\t\twatch specified MIDI client and port\n");
+  printf("  -c, --config=file\t\tread outputs and note mappings from file\n");
+  printf("  -P, --play=file.mid\t\tplay a Standard MIDI File to the outputs\n");
+  printf("  -l, --loop\t\tloop the file given with --play\n");
+  printf("  -r, --record=file\t\trecord received events to a trace file\n");
+  printf("  -n, --record-events=N\t\tkeep the last N events in the trace (65536)\n");
+  printf("  -R, --replay=file\t\treplay a trace recorded with --record\n");
+  printf("  -f, --fast\t\treplay as fast as possible instead of in real time\n");
+  printf("  -w, --writer\t\twrite the GPIO lines from a separate thread\n");
+  printf("  -s, --socket=path\t\taccept commands from midi2gpioctl on a socket\n");
+  printf("  -S, --state=file\t\tkeep the outputs in a file and restore them at startup\n");
+  printf("  -t, --thru[=all|mapped|unmapped]\t\tsend received events on to our subscribers\n");
+  printf("  -F, --feedback[=note|cc]\t\treport every output that switches back to the source\n");
+  printf("  -b, --budget=ms\t\tlongest loop iteration before it counts as a stall (100)\n");
   return;
 }
 
 
-static int stop = 0;
+void print_stats(FILE *fp)
+{
+  fprintf(fp, "commits %lu, transitions %lu, pulses %lu, stuck notes released %lu, panics %lu\n",
+	      stat_commits, stat_transitions, stat_pulses, stat_stuck, stat_panics);
+  if (replay_file) {
+    double secs = replay_seconds();
+    fprintf(fp, "replayed %lu events in %.3f s, %.0f events/s\n", stat_replay_events,
+		secs, secs > 0 ? stat_replay_events / secs : 0);
+  }
+  if (writer_enabled)
+    fprintf(fp, "writer queue high-water %lu, full %lu, coalesced %lu\n",
+		stat_writer_hwm, stat_writer_full, writer_coalesced());
+  if (control_path)
+    fprintf(fp, "control requests %lu\n", stat_control_requests);
+  if (thru_mode)
+    fprintf(fp, "thru events %lu, drains %lu, dropped %lu\n",
+		stat_thru_events, stat_seq_drains, stat_seq_dropped);
+  if (stat_sysex_states)
+    fprintf(fp, "sysex states %lu\n", stat_sysex_states);
+  if (feedback_mode)
+    fprintf(fp, "feedback events %lu\n", stat_feedback_events);
+  if (stat_source_lost)
+    fprintf(fp, "source lost %lu times\n", stat_source_lost);
+  fprintf(fp, "loop iterations %lu, stalls %lu, longest %llu us\n",
+	      stat_loops, stat_stalls, (unsigned long long) stat_loop_max / 1000);
+  if (stat_trace_truncated)
+    fprintf(fp, "trace records truncated %lu\n", stat_trace_truncated);
+  if (play_file)
+    fprintf(fp, "file events played %lu, loops %lu\n", stat_play_events, stat_play_loops);
+  if (npatterns)
+    fprintf(fp, "pattern launches %lu, steps %lu\n",
+		stat_pattern_launches, stat_pattern_steps);
+  if (stat_clock_ticks)
+    fprintf(fp, "clock ticks %lu, resyncs %lu, tempo %.1f bpm\n",
+		stat_clock_ticks, stat_clock_resyncs, clock_bpm());
+  if (ncues)
+    fprintf(fp, "mtc frames %lu, relocations %lu, cues fired %lu of %d\n",
+		stat_mtc_frames, stat_mtc_relocates, stat_cues_fired, ncues);
+  if (ninputs)
+    fprintf(fp, "input edges %lu, filtered %lu, events sent %lu, latency avg %llu us max %llu us\n",
+		stat_input_edges, stat_input_filtered, stat_input_events,
+		(unsigned long long) (stat_input_latency_n ? stat_input_latency_sum / stat_input_latency_n / 1000 : 0),
+		(unsigned long long) stat_input_latency_max / 1000);
+}
+
+
+static volatile sig_atomic_t stop = 0;
+static volatile sig_atomic_t panic_requested = 0;
 
 static void sighandler(int sig)
 {
@@ -305,80 +585,58 @@ static void sighandler(int sig)
   stop = 1;
 }
 
-
-int gpio_setup()
+static void panic_sighandler(int sig)
 {
-  int ret;
-  
-  chip = gpiod_chip_open_by_name(chipname);
-  if (!chip) {
-    perror("Open chip failed\n");
-    goto end;
-  }
-
-  // Configure Line1
-
-  line1 = gpiod_chip_get_line(chip, line1_num);
-  if (!line1) {
-    perror("Get line1 failed\n");
-    goto close_chip;
-  }
-
-  ret = gpiod_line_request_output(line1, GPIOD_CONSUMER, 0);
-  if (ret < 0) {
-    perror("Request line1 as output failed\n");
-    goto release_line;
-  }
-
-  // Configure Line2
-
-  line2 = gpiod_chip_get_line(chip, line2_num);
-  if (!line2) {
-    perror("Get line2 failed\n");
-    goto close_chip;
-  }
-
-  ret = gpiod_line_request_output(line2, GPIOD_CONSUMER, 0);
-  if (ret < 0) {
-    perror("Request line2 as output failed\n");
-    goto release_line;
-  }
+  panic_requested = 1;
+}
 
-  // Configure Line3
+/*
+ * Playback is over once the file or trace has ended and what its last
+ * events started has run out: pulses, holds with a maximum on-time, and
+ * patterns that play a number of times.
+ */
 
-  line3 = gpiod_chip_get_line(chip, line3_num);
-  if (!line3) {
-    perror("Get line3 failed\n");
-    goto close_chip;
-  }
+static int playback_over(void)
+{
+  int i;
 
-  ret = gpiod_line_request_output(line3, GPIOD_CONSUMER, 0);
-  if (ret < 0) {
-    perror("Request line3 as output failed\n");
-    goto release_line;
-  }
+  if (!play_done && !replay_done)
+    return 0;
 
+  if (output_pulsing())
+    return 0;
+  for (i = 0; i < nmappings; i++)
+    if (timer_pending(&mappings[i].hold_timer))
+      return 0;
+  for (i = 0; i < npatterns; i++)
+    if (patterns[i].running && patterns[i].repeat)
+      return 0;
   return 1;
-
- release_line:
-  gpiod_line_release(line1);
-  gpiod_line_release(line2);
-  gpiod_line_release(line3);
- close_chip:
-  gpiod_chip_close(chip);
- end:
-  return 0;
 }
-		
+
+
 int main(int argc, char *argv[])
 {
 
-  static const char short_options[] = "hvp:";
+  static const char short_options[] = "hvp:c:P:lr:n:R:fws:S:b:t::F::";
   static const struct option long_options[] =
     {
      {"help",	0, NULL, 'h'},
      {"verbose", 0, NULL, 'v'},
      {"port", 1, NULL, 'p'},
+     {"config", 1, NULL, 'c'},
+     {"play", 1, NULL, 'P'},
+     {"loop", 0, NULL, 'l'},
+     {"record", 1, NULL, 'r'},
+     {"record-events", 1, NULL, 'n'},
+     {"replay", 1, NULL, 'R'},
+     {"fast", 0, NULL, 'f'},
+     {"writer", 0, NULL, 'w'},
+     {"socket", 1, NULL, 's'},
+     {"state", 1, NULL, 'S'},
+     {"budget", 1, NULL, 'b'},
+     {"thru", 2, NULL, 't'},
+     {"feedback", 2, NULL, 'F'},
      { }
   };
 
@@ -395,6 +653,47 @@ int main(int argc, char *argv[])
     case 'p':
       portspec = strdup(optarg);
       break;
+    case 'c':
+      config_file = strdup(optarg);
+      break;
+    case 'P':
+      play_file = strdup(optarg);
+      break;
+    case 'l':
+      play_loop = 1;
+      break;
+    case 'r':
+      trace_file = strdup(optarg);
+      break;
+    case 'n':
+      trace_nrecords = strtoul(optarg, NULL, 0);
+      break;
+    case 'R':
+      replay_file = strdup(optarg);
+      break;
+    case 'f':
+      replay_fast = 1;
+      break;
+    case 'w':
+      writer_enabled = 1;
+      break;
+    case 's':
+      control_path = strdup(optarg);
+      break;
+    case 'S':
+      state_file = strdup(optarg);
+      break;
+    case 'b':
+      loop_budget = strtoul(optarg, NULL, 0);
+      break;
+    case 't':
+      if (thru_parse(optarg) < 0)
+	return 1;
+      break;
+    case 'F':
+      if (feedback_parse(optarg) < 0)
+	return 1;
+      break;
     default:
       help(argv[0]);
       return 1;
@@ -408,33 +707,113 @@ int main(int argc, char *argv[])
 
   int err;
 
-  open_seq();
-  create_port();
-  subscribe_to_system_events();
-  connect_from_rtpmidi_port();
+  if (config_file) {
+    if (config_load(config_file) < 0)
+      exit(1);
+  }
+  else
+    config_defaults();
+
+  if (feedback_mode)
+    feedback_init();
 
-  int gpio_ok = gpio_setup();
-  if (gpio_ok != 1) {
-    fprintf(stderr, "GPIO configuration failed\n");
+  if (play_file && smf_load(play_file) < 0)
+    exit(1);
+
+  if (replay_file && replay_load(replay_file) < 0)
+    exit(1);
+
+  if (trace_file && trace_open(trace_file, trace_nrecords) < 0)
+    exit(1);
+
+  // backends may start timers when they open
+  if (timers_open() < 0)
+    exit(1);
+
+  if (notify_open() < 0)
+    exit(1);
+
+  // the sequencer, the outputs and the inputs, in parallel
+  if (startup() < 0)
     exit(1);
-  }
 
   // catch signal to exit when user types ^C
   signal(SIGINT, sighandler);
   signal(SIGTERM, sighandler);
+  signal(SIGUSR1, panic_sighandler);
+
+  // the signals are only let in while the main loop waits in ppoll(),
+  // so none is missed between checking for it and going to sleep, and
+  // the threads started from here on never take them
+  sigset_t sigs, waitsigs;
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGTERM);
+  sigaddset(&sigs, SIGUSR1);
+  sigprocmask(SIG_BLOCK, &sigs, &waitsigs);
+  sigdelset(&waitsigs, SIGINT);
+  sigdelset(&waitsigs, SIGTERM);
+  sigdelset(&waitsigs, SIGUSR1);
+
+  if (writer_enabled && writer_start() < 0)
+    exit(1);
+
+  if (announce_start() < 0)
+    exit(1);
+
+  if (control_path && control_open(control_path) < 0)
+    exit(1);
+
+  if (play_file)
+    play_start_now();
+  if (replay_file)
+    replay_start_now();
+  timers_update();
+
 
-  // file descriptors for alsa seq
+  // file descriptors for alsa seq, followed by the timer wheel, the
+  // control socket, the announce thread and the input lines
   struct pollfd *pfds;
-  int npfds;
+  int nseqfds, npfds;
+  int timerfd_idx, control_idx, announce_idx, inputs_idx;
  
-  npfds = snd_seq_poll_descriptors_count(seq, POLLIN);
+  nseqfds = snd_seq_poll_descriptors_count(seq, POLLIN);
+  timerfd_idx = nseqfds;
+  control_idx = timerfd_idx + 1;
+  announce_idx = control_idx + 1;
+  inputs_idx = announce_idx + 1;
+  npfds = inputs_idx + ninputs;
   pfds = alloca(sizeof(*pfds) * npfds);
 
-  for (;;) {
+  // playback may be over before it starts
+  while (!stop && !playback_over()) {
+    static const struct timespec nowait;
 
-    snd_seq_poll_descriptors(seq, pfds, npfds, POLLIN);
-    if (poll(pfds, npfds, -1) < 0)
+    if (panic_requested) {
+      panic_requested = 0;
+      panic("signal");
+      timers_update();
+    }
+
+    snd_seq_poll_descriptors(seq, pfds, nseqfds, POLLIN);
+    pfds[timerfd_idx].fd = timers_fd();
+    pfds[timerfd_idx].events = POLLIN;
+    control_poll_descriptor(&pfds[control_idx]);
+    announce_poll_descriptor(&pfds[announce_idx]);
+    input_poll_descriptors(&pfds[inputs_idx]);
+    if (ppoll(pfds, npfds, replay_pending() ? &nowait : NULL, &waitsigs) < 0) {
+      if (errno == EINTR)
+	continue;
       break;
+    }
+    uint64_t busy = now_ns();
+
+    if (pfds[timerfd_idx].revents & POLLIN)
+      timers_run();
+
+    input_handle(&pfds[inputs_idx]);
+    control_handle(&pfds[control_idx]);
+    announce_handle(&pfds[announce_idx]);
 
     do {
       snd_seq_event_t *event;
@@ -444,23 +823,46 @@ int main(int argc, char *argv[])
 	break;
 
       if (event) {
+	if (trace_file)
+	  trace_event(event, now_ns());
+
 	if (verbose)
 	  log_event(event);
 
 	handle_event(event);
+
+	if (thru_mode)
+	  thru_event(event);
       }
       
     } while (err > 0);
 
-    if (stop)
-      break;
-    
+    replay_step();
+
+    // everything that changed in this iteration goes out in one write,
+    // and what we send in reply, passed on or fed back, in one drain
+    output_commit();
+    seq_flush();
+    timers_update();
+    notify_loop(busy);
   }
 
- release_line:
-  gpiod_line_release(line1);
-  gpiod_line_release(line2);
-  gpiod_line_release(line3);
- close_chip:
-  gpiod_chip_close(chip);
+  // notes still held when playback is over would never be let go
+  if (play_done || replay_done)
+    output_all_off();
+
+  // changes made before the loop, when playback ended at once
+  output_commit_wait();
+  seq_flush();
+
+  notify_stopping();
+  writer_join();
+  print_stats(stdout);
+  trace_close();
+  control_close();
+  announce_close();
+  state_close();
+  notify_close();
+  input_release();
+  gpio_release();
 }
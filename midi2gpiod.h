@@ -0,0 +1,680 @@
+/*
+ * MIDI2GPIOD
+ *
+ * Declarations shared between the source files of midi2gpiod.
+ *
+ * McLaren Labs
+ * 2021
+ *
+ */
+
+#ifndef MIDI2GPIOD_H
+#define MIDI2GPIOD_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <gpiod.h>
+#include <alsa/asoundlib.h>
+
+#ifndef	GPIOD_CONSUMER
+#define	GPIOD_CONSUMER	"midi2gpiod"
+#endif
+
+#define container_of(ptr, type, member) \
+  ((type *)((char *)(ptr) - offsetof(type, member)))
+
+extern int verbose;
+
+extern snd_seq_t *seq;
+extern int seq_client;
+extern int seq_port0;
+extern char *sequencer_type;
+extern int source_addr;
+
+/*
+ * The connected source, written by the announce thread and read by the
+ * main loop: client and port are packed in one word, so that a reader
+ * never sees the client of one source with the port of another.
+ */
+
+static inline int source_get(int *client, int *port)
+{
+  int a = __atomic_load_n(&source_addr, __ATOMIC_ACQUIRE);
+
+  *client = a < 0 ? -1 : a >> 8;
+  *port = a < 0 ? 0 : a & 0xff;
+  return a >= 0;
+}
+
+static inline void source_set(int client, int port)
+{
+  __atomic_store_n(&source_addr, client < 0 ? -1 : client << 8 | port, __ATOMIC_RELEASE);
+}
+
+int check_snd_err(const char *msg, int err);
+void connect_from_rtpmidi_port(snd_seq_t *handle);
+void log_event(const snd_seq_event_t *ev);
+
+/*
+ * Timers
+ *
+ * Timers are kept in a hierarchical timer wheel with a resolution of
+ * one millisecond.  Adding, re-arming and removing a timer are O(1).
+ * The wheel is serviced from the main loop through a timerfd, and
+ * all the timers that expire in the same tick run back to back so
+ * that their output changes are committed together.
+ */
+
+#define TIMER_TICK_NS	1000000ULL
+
+struct timer {
+  struct timer	*next;
+  struct timer	*prev;
+  uint64_t	expires;	// in ticks
+  void		(*fn)(struct timer *t);
+};
+
+void timer_init(struct timer *t, void (*fn)(struct timer *t));
+void timer_add(struct timer *t, unsigned int ms);
+void timer_add_ns(struct timer *t, uint64_t when_ns);
+void timer_del(struct timer *t);
+int timer_pending(const struct timer *t);
+
+uint64_t now_ns(void);
+uint64_t timers_now(void);
+int timers_open(void);
+int timers_fd(void);
+void timers_run(void);
+void timers_update(void);
+
+/*
+ * Outputs
+ *
+ * Every GPIO line that we drive is an `output`.  The program keeps a
+ * shadow copy of the desired state of every output.  Handlers change
+ * the shadow state with output_set(), and output_commit() writes all
+ * the outputs that changed since the last commit, one bulk write per
+ * chip.
+ */
+
+#define MAX_OUTPUTS	256
+#define MAX_CHIPS	8
+#define OUTSET_WORDS	(MAX_OUTPUTS / 64)
+
+struct outset {
+  uint64_t w[OUTSET_WORDS];
+};
+
+static inline int outset_test(const struct outset *s, int i)
+{
+  return (s->w[i >> 6] >> (i & 63)) & 1;
+}
+
+static inline void outset_set(struct outset *s, int i)
+{
+  s->w[i >> 6] |= (1ULL << (i & 63));
+}
+
+static inline void outset_clear(struct outset *s, int i)
+{
+  s->w[i >> 6] &= ~(1ULL << (i & 63));
+}
+
+static inline int outset_empty(const struct outset *s)
+{
+  int i;
+  for (i = 0; i < OUTSET_WORDS; i++)
+    if (s->w[i])
+      return 0;
+  return 1;
+}
+
+static inline int outset_overlap(const struct outset *a, const struct outset *b)
+{
+  int i;
+  for (i = 0; i < OUTSET_WORDS; i++)
+    if (a->w[i] & b->w[i])
+      return 1;
+  return 0;
+}
+
+struct output {
+  char		*name;
+  int		chip;		// index into chips[]
+  unsigned int	offset;		// line offset on the chip
+  int		holds;		// number of active hold mappings
+  unsigned char	level;		// DMX level when on, 255 unless set by a cc
+  struct timer	pulse_timer;
+};
+
+struct writer;
+struct out_chip;
+
+/*
+ * A chip is written through a backend.  By default that is libgpiod;
+ * a `chip` line in the configuration file selects another one.
+ */
+
+struct chip_ops {
+  const char	*type;
+  int		max_lines;	// outputs per chip
+  int		(*setting)(struct out_chip *ch, const char *key, const char *val);
+  int		(*open)(struct out_chip *ch);
+  int		(*write)(struct out_chip *ch, const struct outset *state);
+  void		(*close)(struct out_chip *ch);
+};
+
+struct out_chip {
+  char			*name;
+  const struct chip_ops	*ops;
+  char			*path;		// device, for backends that need one
+  void			*priv;		// backend state
+  struct gpiod_chip	*chip;
+  struct gpiod_line_bulk bulk;
+  int			nouts;
+  int			outs[MAX_OUTPUTS];
+  struct outset		mask;		// the outputs on this chip
+  struct writer		*writer;	// its writer thread, if any
+  const unsigned char	*level;		// levels for the write, from the writer
+};
+
+extern const struct chip_ops gpiod_ops;
+extern const struct chip_ops bcm_ops;
+extern const struct chip_ops spi595_ops;
+extern const struct chip_ops mcp23017_ops;
+extern const struct chip_ops pca9555_ops;
+extern const struct chip_ops artnet_ops;
+extern const struct chip_ops sacn_ops;
+
+extern struct output outputs[MAX_OUTPUTS];
+extern int noutputs;
+extern struct out_chip chips[MAX_CHIPS];
+extern int nchips;
+
+extern struct outset out_state;
+extern struct outset out_dirty;
+extern struct outset out_forced;
+
+extern unsigned long stat_commits;
+extern unsigned long stat_transitions;
+extern unsigned long stat_pulses;
+extern unsigned long stat_stuck;
+extern unsigned long stat_panics;
+
+struct out_chip *chip_declare(const char *name, const char *type, const char *path);
+int output_add(const char *name, const char *chipname, unsigned int offset);
+int output_find(const char *name);
+void output_set(int o, int value);
+void output_level(int o, int value);
+void output_force(int o, int value);
+void output_unforce(int o);
+int output_value(int o);
+void output_sync(void);
+void output_apply(const struct outset *set, const struct outset *clear);
+void output_all_off(void);
+void output_pulse(int o, unsigned int ms);
+int output_pulsing(void);
+int output_commit(void);
+int output_commit_wait(void);
+int chip_write(struct out_chip *ch, const struct outset *state);
+int chips_write(const struct outset *state, const struct outset *dirty);
+int gpio_setup(void);
+void gpio_release(void);
+
+/*
+ * Writer threads
+ *
+ * Optionally every chip is written by a thread of its own, fed through
+ * a lock-free queue of snapshots of the shadow state.
+ */
+
+extern int writer_enabled;
+
+extern unsigned long stat_writer_hwm;
+extern unsigned long stat_writer_full;
+extern unsigned long stat_writer_coalesced;
+
+int writer_push(const struct outset *state, const struct outset *dirty);
+int writer_start(void);
+void writer_join(void);
+unsigned long writer_coalesced(void);
+
+/*
+ * Patterns
+ *
+ * A pattern is a run of steps in one flat array.  Each step waits for
+ * `delay` ms after the previous one, then turns on the outputs in `set`
+ * and off the ones in `clear`.
+ */
+
+#define MAX_PATTERNS	64
+
+struct pattern_step {
+  unsigned int	delay;		// ms after the previous step
+  struct outset	set;
+  struct outset	clear;
+};
+
+struct pattern {
+  char		*name;
+  int		first;		// index of the first step in pattern_steps[]
+  int		nsteps;
+  int		repeat;		// times to play, 0 for as long as the note is held
+  struct outset	touched;	// every output the pattern turns on
+  int		running;
+  int		cur;		// next step to run
+  int		loops_left;
+  uint64_t	next_ns;	// time of the next step
+  struct timer	timer;
+};
+
+extern struct pattern patterns[MAX_PATTERNS];
+extern int npatterns;
+extern struct pattern_step *pattern_steps;
+extern int npattern_steps;
+
+extern unsigned long stat_pattern_launches;
+extern unsigned long stat_pattern_steps;
+
+struct pattern *pattern_add(const char *name);
+struct pattern *pattern_find(const char *name);
+struct pattern_step *pattern_add_step(struct pattern *p, unsigned int delay);
+void pattern_launch(struct pattern *p);
+void pattern_stop(struct pattern *p);
+
+/*
+ * Mappings
+ *
+ * A mapping connects a MIDI note to an output.  In `hold` mode the
+ * output follows Note-On/Note-Off.  In `pulse` mode a Note-On turns
+ * the output on for a fixed width, optionally scaled by velocity, and
+ * Note-Off is ignored.  Mappings for the same note are chained so that
+ * dispatch is a single table lookup.
+ *
+ * In `pattern` mode a Note-On launches a pattern.
+ *
+ * A `level` mapping connects a controller instead of a note: the value
+ * sets the level of the output (for DMX), and 0 turns it off.  They are
+ * chained per controller number in cc_map[].
+ *
+ * A hold mapping may have a maximum on-time.  Its timer is re-armed on
+ * every Note-On, and if the Note-Off is lost the timer releases the
+ * output and counts a stuck note.
+ *
+ * All Notes Off, All Sound Off, the loss of the source or SIGUSR1 is a
+ * panic: every hold, pulse, pattern and generator is dropped and all
+ * the outputs go off in one commit.
+ */
+
+#define MAX_MAPPINGS	512
+
+enum map_mode {
+  MAP_HOLD,
+  MAP_PULSE,
+  MAP_PATTERN,
+  MAP_LEVEL
+};
+
+struct mapping {
+  int		channel;	// 0..15, or -1 for any channel
+  int		note;		// or controller, in level mode
+  int		out;		// index into outputs[], -1 for a pattern
+  enum map_mode	mode;
+  struct pattern *pattern;	// pattern mode: pattern to launch
+  unsigned int	width_min;	// pulse width (ms) at velocity 1
+  unsigned int	width_max;	// pulse width (ms) at velocity 127
+  unsigned int	maxhold;	// hold mode: maximum on-time (ms), 0 for none
+  int		active;		// hold mode: note is down
+  struct timer	hold_timer;
+  struct mapping *next;		// next mapping for the same note or controller
+};
+
+extern struct mapping mappings[MAX_MAPPINGS];
+extern int nmappings;
+extern struct mapping *note_map[128];
+extern struct mapping *cc_map[128];
+
+struct mapping *mapping_add(int note, int out);
+struct mapping *mapping_add_cc(int cc, int out);
+void handle_event(const snd_seq_event_t *ev);
+void panic(const char *why);
+void print_stats(FILE *fp);
+
+/*
+ * Inputs
+ *
+ * An input line is watched for edges, which are sent as Note-On and
+ * Note-Off events on our seq port.  Inputs may be debounced by the
+ * kernel or, where it cannot, in software.
+ */
+
+#define MAX_INPUTS	64
+
+struct input {
+  char		*name;
+  char		*chipname;
+  unsigned int	offset;
+  int		channel;	// 0..15
+  int		note;
+  int		velocity;
+  int		invert;		// active low: falling edge is Note-On
+  int		flags;		// GPIOD_LINE_REQUEST_FLAG_BIAS_*
+  unsigned int	debounce;	// ms, 0 for none
+  struct gpiod_line *line;	// NULL if requested with kernel debounce
+  int		fd;
+  int		kernel_debounce;
+  int		level;		// last level seen on the line
+  int		reported;	// last level sent as MIDI
+  struct timer	debounce_timer;
+};
+
+extern struct input inputs[MAX_INPUTS];
+extern int ninputs;
+
+extern unsigned long stat_input_edges;
+extern unsigned long stat_input_events;
+extern uint64_t stat_input_latency_max;
+extern uint64_t stat_input_latency_sum;
+extern unsigned long stat_input_latency_n;
+extern unsigned long stat_input_filtered;
+
+struct input *input_add(const char *name, const char *chipname, unsigned int offset);
+int input_setup(void);
+void input_release(void);
+int input_poll_descriptors(struct pollfd *pfds);
+void input_handle(const struct pollfd *pfds);
+
+/*
+ * MIDI clock
+ *
+ * A phase-locked loop follows the 24 ppqn MIDI clock and estimates the
+ * tempo.  Generators drive outputs on beat subdivisions, scheduled ahead
+ * of time from the estimate.
+ */
+
+#define MAX_GENERATORS	16
+#define MAX_GEN_OUTS	32
+
+struct midi_clock {
+  int		running;	// between Start/Continue and Stop
+  uint64_t	pos;		// index of the next clock tick
+  uint64_t	next_ns;	// predicted time of the next clock tick
+  uint64_t	last_ns;	// arrival of the last clock tick
+  double	period;		// estimated tick period (ns), 0 if unknown
+};
+
+enum gen_type {
+  GEN_STROBE,
+  GEN_CHASE,
+  GEN_GATE
+};
+
+struct generator {
+  char		*name;
+  enum gen_type	type;
+  int		outs[MAX_GEN_OUTS];
+  int		nouts;
+  unsigned int	every;		// clock ticks per step
+  unsigned int	width;		// strobe: flash width (ms)
+  unsigned int	duty;		// gate: percent of the step the outputs are on
+  uint64_t	step;		// next step to fire
+  struct timer	step_timer;
+  struct timer	off_timer;
+};
+
+extern struct midi_clock midi_clock;
+extern struct generator generators[MAX_GENERATORS];
+extern int ngenerators;
+
+extern unsigned long stat_clock_ticks;
+extern unsigned long stat_clock_resyncs;
+
+struct generator *generator_add(const char *name, enum gen_type type);
+void clock_tick(uint64_t t);
+void clock_start(void);
+void clock_continue(void);
+void clock_stop(void);
+void clock_songpos(int sixteenths);
+double clock_bpm(void);
+
+/*
+ * MIDI Time Code
+ *
+ * The MTC position is tracked from quarter-frame messages and cues from
+ * a sorted list fire as it passes their time.
+ */
+
+enum cue_action {
+  CUE_ON,
+  CUE_OFF,
+  CUE_PULSE
+};
+
+struct cue {
+  uint32_t	time;		// smpte_ordinal()
+  int		out;
+  enum cue_action action;
+  unsigned int	width;		// pulse width (ms)
+  int		seq;		// order in the configuration file
+};
+
+struct mtc {
+  int		locked;		// position is known
+  int		hours, minutes, seconds, frames;
+  int		rate;		// 0: 24, 1: 25, 2: 29.97 drop-frame, 3: 30 fps
+  int		pieces[8];	// quarter-frame nibbles being assembled
+  int		npieces;
+  int		last_piece;
+  uint64_t	last_ns;
+  int		cursor;		// first cue not yet reached
+};
+
+extern struct cue *cues;
+extern int ncues;
+extern struct mtc mtc;
+
+extern unsigned long stat_mtc_frames;
+extern unsigned long stat_mtc_relocates;
+extern unsigned long stat_cues_fired;
+
+uint32_t smpte_ordinal(int h, int m, int s, int f);
+int smpte_parse(const char *str, uint32_t *ordinal);
+struct cue *cue_add(uint32_t time, int out);
+void cues_sort(void);
+void mtc_quarter_frame(int value);
+int mtc_sysex(const unsigned char *buf, unsigned int len);
+
+/*
+ * SysEx bulk state: one message sets a bitmap of outputs
+ */
+
+extern unsigned long stat_sysex_states;
+
+int sysex_bulk_state(const unsigned char *buf, unsigned int len);
+
+/*
+ * Standard MIDI File playback
+ */
+
+extern char *play_file;
+extern int play_loop;
+extern int play_done;
+
+extern unsigned long stat_play_events;
+extern unsigned long stat_play_loops;
+
+int smf_load(const char *path);
+void play_start_now(void);
+
+/*
+ * Event trace
+ *
+ * A trace file is a 64-byte header followed by a ring of fixed-size
+ * records, one per event received from the sequencer.  The header
+ * counts the records ever written; once the ring is full the oldest
+ * are overwritten, and the trace holds the last `nrecords` of them.
+ * Variable-length data (SysEx) is kept inline up to TRACE_DATA bytes;
+ * ev.data.ext.ptr is meaningless in the file.
+ */
+
+#define TRACE_MAGIC		"M2GTRACE"
+#define TRACE_VERSION		1
+#define TRACE_RECORD_SIZE	64
+#define TRACE_DATA		(TRACE_RECORD_SIZE - 8 - sizeof(snd_seq_event_t))
+
+struct trace_header {
+  char		magic[8];
+  uint32_t	version;
+  uint32_t	record_size;
+  uint32_t	nrecords;	// capacity of the ring
+  uint32_t	reserved0;
+  uint64_t	start;		// CLOCK_MONOTONIC ns when recording started
+  uint64_t	count;		// records written since then
+  char		reserved[TRACE_RECORD_SIZE - 40];
+};
+
+struct trace_record {
+  uint64_t		time;	// CLOCK_MONOTONIC ns of arrival
+  snd_seq_event_t	ev;
+  unsigned char		data[TRACE_DATA];
+};
+
+extern char *trace_file;
+extern unsigned int trace_nrecords;
+
+extern unsigned long stat_trace_truncated;
+
+int trace_open(const char *path, unsigned int nrecords);
+void trace_event(const snd_seq_event_t *ev, uint64_t now);
+void trace_close(void);
+
+extern char *replay_file;
+extern int replay_fast;
+extern int replay_done;
+
+extern unsigned long stat_replay_events;
+
+int replay_load(const char *path);
+void replay_start_now(void);
+int replay_pending(void);
+void replay_step(void);
+double replay_seconds(void);
+
+/*
+ * Thru, and events sent from the main loop
+ *
+ * Events for our subscribers are buffered and drained once per batch.
+ */
+
+enum thru_mode {
+  THRU_OFF,
+  THRU_ALL,
+  THRU_MAPPED,		// only the notes and controllers that drive an output
+  THRU_UNMAPPED		// only the events that do not
+};
+
+extern int thru_mode;
+
+extern unsigned long stat_thru_events;
+extern unsigned long stat_seq_drains;
+extern unsigned long stat_seq_dropped;
+
+int thru_parse(const char *s);
+void thru_event(snd_seq_event_t *ev);
+int seq_output(snd_seq_event_t *ev);
+void seq_flush(void);
+
+/*
+ * Pin-state feedback: the outputs that changed level in a commit are
+ * reported as notes or controllers
+ */
+
+enum feedback_mode {
+  FEEDBACK_OFF,
+  FEEDBACK_NOTE,
+  FEEDBACK_CC
+};
+
+extern int feedback_mode;
+
+extern unsigned long stat_feedback_events;
+
+int feedback_parse(const char *s);
+void feedback_init(void);
+void feedback_commit(const struct outset *state, const struct outset *changed);
+
+/*
+ * Output state file
+ */
+
+extern char *state_file;
+
+int state_open(const char *path);
+void state_save(const struct outset *values);
+void state_close(void);
+
+/*
+ * Control socket
+ */
+
+#define CONTROL_REPLY_MAX	65536
+
+extern char *control_path;
+
+extern unsigned long stat_control_requests;
+
+int control_open(const char *path);
+void control_close(void);
+int control_poll_descriptor(struct pollfd *pfd);
+void control_handle(const struct pollfd *pfd);
+
+/*
+ * systemd notification and stall detection
+ */
+
+extern unsigned int loop_budget;
+
+extern unsigned long stat_loops;
+extern unsigned long stat_stalls;
+extern uint64_t stat_loop_max;
+
+int notify_open(void);
+void notify_ready(void);
+void notify_stopping(void);
+void notify_loop(uint64_t start);
+void notify_close(void);
+
+/*
+ * System announcements, on a client and thread of their own
+ */
+
+extern unsigned long stat_source_lost;
+
+int announce_open(void);
+int announce_start(void);
+void announce_close(void);
+int announce_poll_descriptor(struct pollfd *pfd);
+void announce_handle(const struct pollfd *pfd);
+
+/*
+ * Startup
+ */
+
+int seq_setup(void);
+int startup(void);
+
+/*
+ * Configuration
+ */
+
+extern char *config_file;
+
+int config_load(const char *path);
+void config_defaults(void);
+
+#endif
@@ -0,0 +1,280 @@
+/*
+ * MIDI2GPIOD
+ *
+ * MIDI Time Code chase with a cue list.
+ *
+ * MTC arrives as quarter-frame messages (SND_SEQ_EVENT_QFRAME), four per
+ * frame.  Each carries one nibble of the time code, so a full time code
+ * takes eight messages, two frames.  Once all eight pieces have arrived
+ * in order the position is known; from then on it is extrapolated one
+ * frame for every four quarter frames without waiting for the next
+ * complete time code.  A full-frame SysEx message relocates immediately.
+ *
+ * Cues are loaded from the configuration file into an array sorted by
+ * time, with a cursor at the first cue not yet fired.  When the position
+ * advances by a frame, firing the due cues is a comparison against the
+ * cue under the cursor.  A jump in position (the show was relocated) is
+ * a binary search for the new cursor; the cues jumped over do not fire.
+ *
+ * Times are compared as ((hours * 60 + minutes) * 60 + seconds) * 32 +
+ * frames, which orders correctly at any frame rate.
+ *
+ * McLaren Labs
+ * 2021
+ *
+ */
+
+#include "midi2gpiod.h"
+
+// a forward jump of more than this many frames is a relocation
+#define MTC_CHASE_FRAMES	8
+
+// quarter frames further apart than this mean the transport stopped
+#define MTC_TIMEOUT_NS		100000000ULL
+
+struct cue *cues;
+int ncues;
+static int cues_size;
+
+struct mtc mtc;
+
+unsigned long stat_mtc_frames;
+unsigned long stat_mtc_relocates;
+unsigned long stat_cues_fired;
+
+static const int mtc_fps[4] = { 24, 25, 30, 30 };	// 29.97 drop-frame counts as 30
+
+uint32_t smpte_ordinal(int h, int m, int s, int f)
+{
+  return ((((uint32_t) h * 60 + m) * 60 + s) << 5) | f;
+}
+
+/*
+ * Parse HH:MM:SS:FF into an ordinal.  Returns 0 on success.
+ */
+
+int smpte_parse(const char *str, uint32_t *ordinal)
+{
+  int h, m, s, f;
+  char c;
+
+  if (sscanf(str, "%d:%d:%d:%d%c", &h, &m, &s, &f, &c) != 4)
+    return -1;
+  if (h < 0 || h > 23 || m < 0 || m > 59 || s < 0 || s > 59 || f < 0 || f > 29)
+    return -1;
+  *ordinal = smpte_ordinal(h, m, s, f);
+  return 0;
+}
+
+struct cue *cue_add(uint32_t time, int out)
+{
+  struct cue *c;
+
+  if (ncues == cues_size) {
+    int size = cues_size ? cues_size * 2 : 64;
+    struct cue *p = realloc(cues, size * sizeof(*cues));
+    if (!p) {
+      perror("cue_add");
+      return NULL;
+    }
+    cues = p;
+    cues_size = size;
+  }
+
+  c = &cues[ncues];
+  c->time = time;
+  c->out = out;
+  c->action = CUE_ON;
+  c->width = 0;
+  c->seq = ncues++;
+  return c;
+}
+
+static int cue_cmp(const void *a, const void *b)
+{
+  const struct cue *x = a, *y = b;
+
+  if (x->time != y->time)
+    return x->time < y->time ? -1 : 1;
+  return x->seq - y->seq;	// cues at the same time keep file order
+}
+
+/*
+ * Called once after the configuration is loaded.
+ */
+
+void cues_sort(void)
+{
+  qsort(cues, ncues, sizeof(*cues), cue_cmp);
+  mtc.cursor = 0;
+}
+
+/*
+ * Index of the first cue later than `time`.
+ */
+
+static int cue_search(uint32_t time)
+{
+  int lo = 0, hi = ncues;
+
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (cues[mid].time <= time)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static void cue_fire(const struct cue *c)
+{
+  if (verbose) {
+    uint32_t secs = c->time >> 5;
+    printf("Cue %02u:%02u:%02u:%02u %s\n", secs / 3600, secs / 60 % 60,
+	   secs % 60, c->time & 31, outputs[c->out].name);
+  }
+
+  switch (c->action) {
+  case CUE_ON:
+    output_set(c->out, 1);
+    break;
+  case CUE_OFF:
+    output_set(c->out, 0);
+    break;
+  case CUE_PULSE:
+    output_pulse(c->out, c->width);
+    break;
+  }
+  stat_cues_fired++;
+}
+
+/*
+ * The position changed from `from` to `to`.  Fire the cues in between,
+ * or relocate the cursor if this was a jump.
+ */
+
+static void mtc_moved(uint32_t from, uint32_t to, int jump)
+{
+  if (!jump && to >= from) {
+    while (mtc.cursor < ncues && cues[mtc.cursor].time <= to)
+      cue_fire(&cues[mtc.cursor++]);
+    return;
+  }
+
+  stat_mtc_relocates++;
+  mtc.cursor = cue_search(to);
+}
+
+static uint32_t mtc_position(void)
+{
+  return smpte_ordinal(mtc.hours, mtc.minutes, mtc.seconds, mtc.frames);
+}
+
+/*
+ * Advance a time code by one frame, honoring drop-frame numbering.
+ */
+
+static void smpte_step(int *h, int *m, int *s, int *f, int rate)
+{
+  if (++*f < mtc_fps[rate])
+    return;
+
+  *f = 0;
+  if (++*s == 60) {
+    *s = 0;
+    if (++*m == 60) {
+      *m = 0;
+      *h = (*h + 1) % 24;
+    }
+    // 29.97 drop-frame skips frames 0 and 1 except every tenth minute
+    if (rate == 2 && *m % 10 != 0)
+      *f = 2;
+  }
+}
+
+/*
+ * Set the position and report the move.  A move that is not a small
+ * step forward is a relocation.
+ */
+
+static void mtc_locate(int h, int m, int s, int f, int rate)
+{
+  uint32_t from = mtc_position();
+  int was_locked = mtc.locked;
+  uint32_t to;
+
+  mtc.hours = h;
+  mtc.minutes = m;
+  mtc.seconds = s;
+  mtc.frames = f;
+  mtc.rate = rate;
+  mtc.locked = 1;
+
+  to = mtc_position();
+  mtc_moved(from, to, !was_locked || to < from ||
+	    to - from > (MTC_CHASE_FRAMES << 5));
+}
+
+/*
+ * One quarter-frame message.
+ */
+
+void mtc_quarter_frame(int value)
+{
+  int piece = (value >> 4) & 7;
+  int nibble = value & 15;
+  uint64_t now = now_ns();
+
+  // pieces must arrive in order and without a pause; anything else
+  // drops the lock until a complete time code has been seen again
+  if (piece != ((mtc.last_piece + 1) & 7) || now - mtc.last_ns > MTC_TIMEOUT_NS) {
+    mtc.locked = 0;
+    mtc.npieces = 0;
+  }
+  mtc.last_piece = piece;
+  mtc.last_ns = now;
+
+  if (piece == 0)
+    mtc.npieces = 0;
+  mtc.pieces[piece] = nibble;
+  mtc.npieces++;
+
+  // the first and fifth pieces start a new frame
+  if (mtc.locked && (piece == 0 || piece == 4)) {
+    uint32_t from = mtc_position();
+    smpte_step(&mtc.hours, &mtc.minutes, &mtc.seconds, &mtc.frames, mtc.rate);
+    stat_mtc_frames++;
+    mtc_moved(from, mtc_position(), 0);
+  }
+
+  if (piece == 7 && mtc.npieces == 8) {
+    int f = mtc.pieces[0] | (mtc.pieces[1] & 1) << 4;
+    int s = mtc.pieces[2] | (mtc.pieces[3] & 3) << 4;
+    int m = mtc.pieces[4] | (mtc.pieces[5] & 3) << 4;
+    int h = mtc.pieces[6] | (mtc.pieces[7] & 1) << 4;
+    int rate = (mtc.pieces[7] >> 1) & 3;
+
+    // the code gave the time of piece 0, and we are now in the next frame
+    smpte_step(&h, &m, &s, &f, rate);
+    if (!mtc.locked || smpte_ordinal(h, m, s, f) != mtc_position())
+      mtc_locate(h, m, s, f, rate);
+  }
+}
+
+/*
+ * Full-frame message: F0 7F dev 01 01 hr mn sc fr F7.
+ */
+
+int mtc_sysex(const unsigned char *buf, unsigned int len)
+{
+  if (len != 10 || buf[0] != 0xf0 || buf[1] != 0x7f ||
+      buf[3] != 0x01 || buf[4] != 0x01 || buf[9] != 0xf7)
+    return 0;
+
+  mtc_locate(buf[5] & 0x1f, buf[6] & 0x3f, buf[7] & 0x3f, buf[8] & 0x1f,
+	     (buf[5] >> 5) & 3);
+  mtc.last_piece = 7;
+  mtc.npieces = 0;
+  return 1;
+}
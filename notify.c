@@ -0,0 +1,151 @@
+/*
+ * MIDI2GPIOD
+ *
+ * systemd notification and event loop stall detection.
+ *
+ * Under a Type=notify service systemd passes the path of a datagram
+ * socket in $NOTIFY_SOCKET, and with WatchdogSec= the watchdog period
+ * in $WATCHDOG_USEC.  The protocol is one datagram of "KEY=VALUE"
+ * lines per message, simple enough that we speak it here rather than
+ * link libsystemd.
+ *
+ * The main loop times every iteration, from the return of poll() to
+ * the end of the commit, so the wait for events is not counted.  An
+ * iteration longer than the budget (--budget, 100 ms) is a stall.  The
+ * watchdog is only fed at the end of an iteration that finished within
+ * the budget: a loop wedged in a GPIO write, or stalling on every
+ * iteration, stops feeding it and systemd restarts the service.  A
+ * timer at half the watchdog period wakes an idle loop to feed it.
+ *
+ * McLaren Labs
+ * 2021
+ *
+ */
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "midi2gpiod.h"
+
+unsigned int loop_budget = 100;	// ms
+
+unsigned long stat_loops;
+unsigned long stat_stalls;
+uint64_t stat_loop_max;		// ns, the longest iteration
+
+static int notify_fd = -1;
+static struct sockaddr_un notify_addr;
+static socklen_t notify_addrlen;
+
+static unsigned int watchdog_ms;	// half the watchdog period, 0 for none
+static int watchdog_due;
+static struct timer watchdog_timer;
+
+static void watchdog_expired(struct timer *t)
+{
+  watchdog_due = 1;
+  timer_add(&watchdog_timer, watchdog_ms);
+}
+
+/*
+ * Open the notification socket, if we run under systemd.  Returns 0,
+ * or -1 on error.
+ */
+
+int notify_open(void)
+{
+  const char *path = getenv("NOTIFY_SOCKET");
+  const char *usec = getenv("WATCHDOG_USEC");
+  const char *pid = getenv("WATCHDOG_PID");
+
+  if (!path || !*path)
+    return 0;
+
+  if ((path[0] != '/' && path[0] != '@') ||
+      strlen(path) >= sizeof(notify_addr.sun_path)) {
+    fprintf(stderr, "NOTIFY_SOCKET: bad socket path %s\n", path);
+    return -1;
+  }
+
+  memset(&notify_addr, 0, sizeof(notify_addr));
+  notify_addr.sun_family = AF_UNIX;
+  strcpy(notify_addr.sun_path, path);
+  if (path[0] == '@')
+    notify_addr.sun_path[0] = 0;		// abstract namespace
+  notify_addrlen = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+
+  notify_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (notify_fd < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  // the watchdog is for us, unless it names another process
+  if (usec && (!pid || (pid_t) strtol(pid, NULL, 10) == getpid())) {
+    watchdog_ms = strtoull(usec, NULL, 10) / 2000;
+    if (watchdog_ms == 0)
+      watchdog_ms = 1;
+    timer_init(&watchdog_timer, watchdog_expired);
+    timer_add(&watchdog_timer, watchdog_ms);
+    if (verbose)
+      printf("Watchdog every %u ms, loop budget %u ms\n", watchdog_ms, loop_budget);
+  }
+
+  return 0;
+}
+
+static void notify_send(const char *msg)
+{
+  if (notify_fd < 0)
+    return;
+
+  // never wait for systemd: a message that does not fit is dropped
+  if (sendto(notify_fd, msg, strlen(msg), MSG_NOSIGNAL,
+	     (struct sockaddr *) &notify_addr, notify_addrlen) < 0 && verbose)
+    perror("notify");
+}
+
+void notify_ready(void)
+{
+  notify_send("READY=1");
+}
+
+void notify_stopping(void)
+{
+  notify_send("STOPPING=1");
+}
+
+/*
+ * End of a loop iteration that started working at `start`.
+ */
+
+void notify_loop(uint64_t start)
+{
+  uint64_t busy = now_ns() - start;
+
+  stat_loops++;
+  if (busy > stat_loop_max)
+    stat_loop_max = busy;
+
+  if (busy > (uint64_t) loop_budget * 1000000ULL) {
+    stat_stalls++;
+    if (verbose)
+      printf("Loop stalled for %llu ms\n", (unsigned long long) busy / 1000000);
+    return;
+  }
+
+  if (watchdog_due) {
+    watchdog_due = 0;
+    notify_send("WATCHDOG=1");
+  }
+}
+
+void notify_close(void)
+{
+  if (notify_fd < 0)
+    return;
+  if (watchdog_ms)
+    timer_del(&watchdog_timer);
+  close(notify_fd);
+  notify_fd = -1;
+}
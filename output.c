@@ -0,0 +1,495 @@
+/*
+ * MIDI2GPIOD
+ *
+ * Output lines.  The handlers only touch the shadow state of the
+ * outputs; output_commit() writes everything that changed with one
+ * write per chip, through the backend of the chip.  The libgpiod
+ * backend, the default, is here: one gpiod_line_set_value_bulk() per
+ * chip.
+ *
+ * McLaren Labs
+ * 2021
+ *
+ */
+
+#include <time.h>
+#include "midi2gpiod.h"
+
+struct output outputs[MAX_OUTPUTS];
+int noutputs;
+
+struct out_chip chips[MAX_CHIPS];
+int nchips;
+
+struct outset out_state;	// desired value of every output
+struct outset out_dirty;	// outputs changed since the last commit
+static struct outset out_written;	// value of every output at the last commit
+struct outset out_forced;	// outputs held by the control socket
+static struct outset out_force_val;	// and the values they are held at
+
+unsigned long stat_commits;
+unsigned long stat_transitions;	// lines that changed level
+unsigned long stat_pulses;
+
+static void pulse_expired(struct timer *t);
+
+static const struct chip_ops *backends[] = {
+  &gpiod_ops,
+  &bcm_ops,
+  &spi595_ops,
+  &mcp23017_ops,
+  &pca9555_ops,
+  &artnet_ops,
+  &sacn_ops,
+};
+
+static struct out_chip *chip_new(const char *name, const struct chip_ops *ops)
+{
+  struct out_chip *ch;
+
+  if (nchips == MAX_CHIPS) {
+    fprintf(stderr, "Too many chips (max %d)\n", MAX_CHIPS);
+    return NULL;
+  }
+
+  ch = &chips[nchips++];
+  ch->name = strdup(name);
+  ch->ops = ops;
+  ch->nouts = 0;
+  return ch;
+}
+
+/*
+ * Declare a chip with backend `type`.  Its settings are then passed to
+ * ops->setting().  Returns the chip, or NULL.
+ */
+
+struct out_chip *chip_declare(const char *name, const char *type, const char *path)
+{
+  struct out_chip *ch;
+  unsigned int i;
+  int c;
+
+  for (c = 0; c < nchips; c++)
+    if (strcmp(chips[c].name, name) == 0) {
+      fprintf(stderr, "Chip '%s' declared twice, or after its outputs\n", name);
+      return NULL;
+    }
+
+  for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++)
+    if (strcmp(backends[i]->type, type) == 0)
+      break;
+  if (i == sizeof(backends) / sizeof(backends[0])) {
+    fprintf(stderr, "Unknown chip type '%s'\n", type);
+    return NULL;
+  }
+
+  ch = chip_new(name, backends[i]);
+  if (ch && path)
+    ch->path = strdup(path);
+  return ch;
+}
+
+/*
+ * The chip called `name`.  A chip that was not declared is a gpiochip.
+ */
+
+static int chip_find(const char *name)
+{
+  int i;
+
+  for (i = 0; i < nchips; i++)
+    if (strcmp(chips[i].name, name) == 0)
+      return i;
+
+  return chip_new(name, &gpiod_ops) ? nchips - 1 : -1;
+}
+
+/*
+ * Declare an output line.  Returns the index of the new output or -1.
+ */
+
+int output_add(const char *name, const char *chipname, unsigned int offset)
+{
+  int c, o;
+
+  if (output_find(name) >= 0) {
+    fprintf(stderr, "Output '%s' declared twice\n", name);
+    return -1;
+  }
+
+  if (noutputs == MAX_OUTPUTS) {
+    fprintf(stderr, "Too many outputs (max %d)\n", MAX_OUTPUTS);
+    return -1;
+  }
+
+  c = chip_find(chipname);
+  if (c < 0)
+    return -1;
+
+  if (chips[c].nouts == chips[c].ops->max_lines) {
+    fprintf(stderr, "Too many outputs on chip '%s'\n", chipname);
+    return -1;
+  }
+
+  o = noutputs++;
+  outputs[o].name = strdup(name);
+  outputs[o].chip = c;
+  outputs[o].offset = offset;
+  outputs[o].holds = 0;
+  outputs[o].level = 255;
+  timer_init(&outputs[o].pulse_timer, pulse_expired);
+
+  chips[c].outs[chips[c].nouts++] = o;
+  outset_set(&chips[c].mask, o);
+  return o;
+}
+
+int output_find(const char *name)
+{
+  int i;
+
+  for (i = 0; i < noutputs; i++)
+    if (strcmp(outputs[i].name, name) == 0)
+      return i;
+  return -1;
+}
+
+void output_set(int o, int value)
+{
+  if (outset_test(&out_state, o) == !!value)
+    return;
+
+  if (value)
+    outset_set(&out_state, o);
+  else
+    outset_clear(&out_state, o);
+  outset_set(&out_dirty, o);
+}
+
+/*
+ * Hold an output at `value` whatever the mappings do, until released.
+ */
+
+void output_force(int o, int value)
+{
+  outset_set(&out_forced, o);
+  if (value)
+    outset_set(&out_force_val, o);
+  else
+    outset_clear(&out_force_val, o);
+  outset_set(&out_dirty, o);
+}
+
+void output_unforce(int o)
+{
+  if (!outset_test(&out_forced, o))
+    return;
+  outset_clear(&out_forced, o);
+  outset_set(&out_dirty, o);
+}
+
+/*
+ * The value an output is written with.
+ */
+
+int output_value(int o)
+{
+  if (outset_test(&out_forced, o))
+    return outset_test(&out_force_val, o);
+  return outset_test(&out_state, o);
+}
+
+/*
+ * The chips are about to be opened with the shadow state as their
+ * initial values; there is nothing to commit.
+ */
+
+void output_sync(void)
+{
+  out_written = out_state;
+  memset(&out_dirty, 0, sizeof(out_dirty));
+}
+
+/*
+ * Set the level of an output from a controller value, 0..127.  The
+ * output is on at any level but 0, and a DMX output sends the level.
+ */
+
+void output_level(int o, int value)
+{
+  if (value) {
+    outputs[o].level = value * 2 + (value >> 6);	// 127 is 255
+    outset_set(&out_dirty, o);
+  }
+  output_set(o, value > 0);
+}
+
+/*
+ * Turn on the outputs in `set` and off the ones in `clear`, a word at
+ * a time.
+ */
+
+void output_apply(const struct outset *set, const struct outset *clear)
+{
+  int i;
+
+  for (i = 0; i < OUTSET_WORDS; i++) {
+    uint64_t w = (out_state.w[i] & ~clear->w[i]) | set->w[i];
+    out_dirty.w[i] |= w ^ out_state.w[i];
+    out_state.w[i] = w;
+  }
+}
+
+/*
+ * Turn an output on and schedule it to turn off again after `ms`
+ * milliseconds.  Pulsing an output that is already pulsing restarts the
+ * pulse.
+ */
+
+void output_pulse(int o, unsigned int ms)
+{
+  output_set(o, 1);
+  timer_add(&outputs[o].pulse_timer, ms);
+  stat_pulses++;
+}
+
+static void pulse_expired(struct timer *t)
+{
+  struct output *out = container_of(t, struct output, pulse_timer);
+
+  // a hold mapping on the same line keeps it on
+  output_set(out - outputs, out->holds > 0);
+}
+
+/*
+ * Is an output waiting for the end of its pulse?
+ */
+
+int output_pulsing(void)
+{
+  int o;
+
+  for (o = 0; o < noutputs; o++)
+    if (timer_pending(&outputs[o].pulse_timer))
+      return 1;
+  return 0;
+}
+
+/*
+ * Turn every output off: pulses are cut short and hold counts cleared.
+ * Forced outputs keep their forced value.
+ */
+
+void output_all_off(void)
+{
+  static const struct outset none;
+  struct outset all;
+  int o;
+
+  for (o = 0; o < noutputs; o++) {
+    outputs[o].holds = 0;
+    timer_del(&outputs[o].pulse_timer);
+  }
+
+  memset(&all, 0xff, sizeof(all));
+  output_apply(&none, &all);
+}
+
+/*
+ * Write the outputs of one chip from `state`.  Returns 0, or -1 on
+ * error.
+ */
+
+int chip_write(struct out_chip *ch, const struct outset *state)
+{
+  return ch->ops->write(ch, state);
+}
+
+/*
+ * Write `state` to every chip with an output in `dirty`.  Returns the
+ * number of chips written, or -1 on error.
+ */
+
+int chips_write(const struct outset *state, const struct outset *dirty)
+{
+  int c, n = 0;
+
+  for (c = 0; c < nchips; c++) {
+    if (!outset_overlap(&chips[c].mask, dirty))
+      continue;
+
+    if (chip_write(&chips[c], state) < 0)
+      n = -1;
+    else if (n >= 0)
+      n++;
+  }
+
+  return n;
+}
+
+static void commit_retry_expired(struct timer *t)
+{
+  // nothing to do: the main loop commits on the way out
+}
+
+/*
+ * Write the outputs that changed since the last commit, or hand them
+ * to the writer thread.  Returns the number of chips written, or -1 on
+ * error.
+ */
+
+int output_commit(void)
+{
+  static struct timer commit_retry = { .fn = commit_retry_expired };
+  struct outset state, changed;
+  int i, n = 0;
+
+  if (outset_empty(&out_dirty))
+    return 0;
+
+  // forced outputs keep their forced value
+  for (i = 0; i < OUTSET_WORDS; i++)
+    state.w[i] = (out_state.w[i] & ~out_forced.w[i]) |
+      (out_force_val.w[i] & out_forced.w[i]);
+
+  if (writer_enabled) {
+    if (writer_push(&state, &out_dirty) < 0) {
+      // the writer is behind; keep the changes and come back
+      timer_add(&commit_retry, 1);
+      return 0;
+    }
+  }
+  else
+    n = chips_write(&state, &out_dirty);
+
+  // what the mappings drive; forces are not kept across a restart
+  state_save(&out_state);
+
+  for (i = 0; i < OUTSET_WORDS; i++) {
+    changed.w[i] = state.w[i] ^ out_written.w[i];
+    stat_transitions += __builtin_popcountll(changed.w[i]);
+    out_written.w[i] = state.w[i];
+  }
+
+  if (feedback_mode)
+    feedback_commit(&state, &changed);
+
+  memset(&out_dirty, 0, sizeof(out_dirty));
+  stat_commits++;
+  return n;
+}
+
+/*
+ * Commit, and when the writers are behind, wait for room in their
+ * queues instead of coming back on a later iteration: for a panic, and
+ * for the last commit before exit, which has no later iteration.
+ */
+
+int output_commit_wait(void)
+{
+  static const struct timespec backoff = { 0, 100000 };
+  int n;
+
+  while ((n = output_commit()) == 0 && !outset_empty(&out_dirty))
+    nanosleep(&backoff, NULL);
+  return n;
+}
+
+static int gpiod_chip_write(struct out_chip *ch, const struct outset *state)
+{
+  int values[GPIOD_LINE_BULK_MAX_LINES];
+  int i;
+
+  for (i = 0; i < ch->nouts; i++)
+    values[i] = outset_test(state, ch->outs[i]);
+
+  if (gpiod_line_set_value_bulk(&ch->bulk, values) < 0) {
+    perror("gpiod_line_set_value_bulk");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Open a gpiochip and request all of its output lines in one bulk
+ * request, with the values of the shadow state: all off, unless they
+ * were restored from the state file.  Returns 1 on success.
+ */
+
+static int gpiod_chip_setup(struct out_chip *ch)
+{
+  int defaults[GPIOD_LINE_BULK_MAX_LINES];
+  unsigned int offsets[GPIOD_LINE_BULK_MAX_LINES];
+  int i, ret;
+
+  ch->chip = gpiod_chip_open_lookup(ch->path ? ch->path : ch->name);
+  if (!ch->chip) {
+    fprintf(stderr, "Open chip '%s' failed: %s\n", ch->name, strerror(errno));
+    return 0;
+  }
+
+  for (i = 0; i < ch->nouts; i++) {
+    offsets[i] = outputs[ch->outs[i]].offset;
+    defaults[i] = outset_test(&out_state, ch->outs[i]);
+  }
+
+  ret = gpiod_chip_get_lines(ch->chip, offsets, ch->nouts, &ch->bulk);
+  if (ret < 0) {
+    fprintf(stderr, "Get lines of '%s' failed: %s\n", ch->name, strerror(errno));
+    gpiod_chip_close(ch->chip);
+    return 0;
+  }
+
+  ret = gpiod_line_request_bulk_output(&ch->bulk, GPIOD_CONSUMER, defaults);
+  if (ret < 0) {
+    fprintf(stderr, "Request lines of '%s' as output failed: %s\n", ch->name, strerror(errno));
+    gpiod_chip_close(ch->chip);
+    return 0;
+  }
+
+  return 1;
+}
+
+static void gpiod_chip_release(struct out_chip *ch)
+{
+  gpiod_line_release_bulk(&ch->bulk);
+  gpiod_chip_close(ch->chip);
+}
+
+const struct chip_ops gpiod_ops = {
+  .type		= "gpiod",
+  .max_lines	= GPIOD_LINE_BULK_MAX_LINES,
+  .open		= gpiod_chip_setup,
+  .write	= gpiod_chip_write,
+  .close	= gpiod_chip_release,
+};
+
+/*
+ * Open every chip through its backend, with its outputs at their
+ * initial values.  Returns 1 on success.
+ */
+
+int gpio_setup(void)
+{
+  int c;
+
+  for (c = 0; c < nchips; c++)
+    if (chips[c].ops->open(&chips[c]) != 1)
+      goto fail;
+
+  return 1;
+
+ fail:
+  while (c-- > 0)
+    chips[c].ops->close(&chips[c]);
+  return 0;
+}
+
+void gpio_release(void)
+{
+  int c;
+
+  for (c = 0; c < nchips; c++)
+    chips[c].ops->close(&chips[c]);
+}
@@ -0,0 +1,159 @@
+/*
+ * MIDI2GPIOD
+ *
+ * Pattern sequencer.  A note can launch a pattern: a sequence of steps,
+ * each a delay followed by a set of outputs to turn on and a set to turn
+ * off.  The steps of all patterns live in one flat array, so running a
+ * step is two word-wise mask operations on the shadow state.
+ *
+ * Every running pattern keeps the absolute time of its next step and
+ * waits for it on the timer wheel, so delays do not accumulate drift.
+ * All the patterns with a step due in the same tick are advanced back to
+ * back, and their changes go out in the same commit.
+ *
+ * McLaren Labs
+ * 2021
+ *
+ */
+
+#include "midi2gpiod.h"
+
+struct pattern patterns[MAX_PATTERNS];
+int npatterns;
+
+struct pattern_step *pattern_steps;
+int npattern_steps;
+static int pattern_steps_size;
+
+unsigned long stat_pattern_launches;
+unsigned long stat_pattern_steps;
+
+static void pattern_expired(struct timer *t);
+
+struct pattern *pattern_add(const char *name)
+{
+  struct pattern *p;
+
+  if (pattern_find(name)) {
+    fprintf(stderr, "Pattern '%s' declared twice\n", name);
+    return NULL;
+  }
+
+  if (npatterns == MAX_PATTERNS) {
+    fprintf(stderr, "Too many patterns (max %d)\n", MAX_PATTERNS);
+    return NULL;
+  }
+
+  p = &patterns[npatterns++];
+  memset(p, 0, sizeof(*p));
+  p->name = strdup(name);
+  p->first = npattern_steps;
+  p->repeat = 1;
+  timer_init(&p->timer, pattern_expired);
+  return p;
+}
+
+struct pattern *pattern_find(const char *name)
+{
+  int i;
+
+  for (i = 0; i < npatterns; i++)
+    if (strcmp(patterns[i].name, name) == 0)
+      return &patterns[i];
+  return NULL;
+}
+
+/*
+ * Append a step to pattern `p`, which must be the last pattern added.
+ */
+
+struct pattern_step *pattern_add_step(struct pattern *p, unsigned int delay)
+{
+  struct pattern_step *s;
+
+  if (npattern_steps == pattern_steps_size) {
+    int size = pattern_steps_size ? pattern_steps_size * 2 : 64;
+    struct pattern_step *n = realloc(pattern_steps, size * sizeof(*n));
+    if (!n) {
+      perror("pattern_add_step");
+      return NULL;
+    }
+    pattern_steps = n;
+    pattern_steps_size = size;
+  }
+
+  s = &pattern_steps[npattern_steps++];
+  memset(s, 0, sizeof(*s));
+  s->delay = delay;
+  p->nsteps++;
+  return s;
+}
+
+/*
+ * Run the steps of a pattern that are due at `now`, and wait for the
+ * next one.  Steps with no delay run immediately.
+ */
+
+static void pattern_run(struct pattern *p, uint64_t now)
+{
+  while (p->running) {
+    const struct pattern_step *s = &pattern_steps[p->first + p->cur];
+
+    if (p->next_ns > now) {
+      timer_add_ns(&p->timer, p->next_ns);
+      return;
+    }
+
+    output_apply(&s->set, &s->clear);
+    stat_pattern_steps++;
+
+    if (++p->cur == p->nsteps) {
+      p->cur = 0;
+      if (p->repeat && --p->loops_left == 0) {
+	p->running = 0;
+	return;
+      }
+    }
+    p->next_ns += (uint64_t) pattern_steps[p->first + p->cur].delay * 1000000ULL;
+  }
+}
+
+static void pattern_expired(struct timer *t)
+{
+  struct pattern *p = container_of(t, struct pattern, timer);
+
+  pattern_run(p, now_ns());
+}
+
+/*
+ * Start a pattern from its first step, restarting it if it runs.
+ */
+
+void pattern_launch(struct pattern *p)
+{
+  if (p->nsteps == 0)
+    return;
+
+  p->running = 1;
+  p->cur = 0;
+  p->loops_left = p->repeat;
+  p->next_ns = now_ns() + (uint64_t) pattern_steps[p->first].delay * 1000000ULL;
+  stat_pattern_launches++;
+  pattern_run(p, now_ns());
+}
+
+/*
+ * Stop a pattern and turn off every output it drives.
+ */
+
+void pattern_stop(struct pattern *p)
+{
+  static const struct outset none;
+
+  if (!p->running)
+    return;
+
+  p->running = 0;
+  timer_del(&p->timer);
+  output_apply(&none, &p->touched);
+}
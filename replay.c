@@ -0,0 +1,196 @@
+/*
+ * MIDI2GPIOD
+ *
+ * Trace replay.
+ *
+ * With `--replay FILE` the events of a trace recorded with --record are
+ * fed to handle_event(), in this process, as if they had just arrived
+ * from the sequencer.  The outputs, mappings and timers behave exactly
+ * as they did live, so an incident on stage becomes a test that can be
+ * run again and again, and timed.
+ *
+ * By default the events are replayed with their original spacing, each
+ * at an absolute deadline from the start of the replay.  With --fast
+ * they are replayed one per iteration of the main loop, each followed
+ * by its own commit, as fast as the program can go; the events per
+ * second reported at the end are then the throughput of the dispatch
+ * path and the GPIO writes.
+ *
+ * Announcements from the system client are not replayed, as they would
+ * make us connect to ports that may no longer exist.
+ *
+ * McLaren Labs
+ * 2021
+ *
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "midi2gpiod.h"
+
+char *replay_file = NULL;
+int replay_fast = 0;
+int replay_done = 0;
+
+unsigned long stat_replay_events;
+
+static const struct trace_header *replay_hdr;
+static const struct trace_record *replay_ring;
+static uint32_t replay_first;	// slot of the oldest record
+static uint32_t replay_count;	// records in the ring
+
+static uint32_t cursor;
+static uint64_t replay_start;
+static uint64_t replay_end;
+static struct timer replay_timer;
+
+/*
+ * Map a trace and find its oldest record.  Returns 0 on success.
+ */
+
+int replay_load(const char *path)
+{
+  const struct trace_header *h;
+  struct stat st;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    perror(path);
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+
+  h = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (h == MAP_FAILED) {
+    perror(path);
+    return -1;
+  }
+
+  if ((size_t) st.st_size < sizeof(*h) ||
+      memcmp(h->magic, TRACE_MAGIC, sizeof(h->magic)) != 0 ||
+      h->version != TRACE_VERSION || h->record_size != TRACE_RECORD_SIZE ||
+      h->nrecords == 0 ||
+      (uint64_t) st.st_size < (uint64_t) (h->nrecords + 1) * TRACE_RECORD_SIZE) {
+    fprintf(stderr, "%s: not a midi2gpiod trace\n", path);
+    munmap((void *) h, st.st_size);
+    return -1;
+  }
+
+  replay_hdr = h;
+  replay_ring = (const struct trace_record *) (h + 1);
+  if (h->count > h->nrecords) {
+    replay_first = h->count % h->nrecords;
+    replay_count = h->nrecords;
+  }
+  else {
+    replay_first = 0;
+    replay_count = h->count;
+  }
+
+  if (verbose)
+    printf("Loaded %s: %u events\n", path, replay_count);
+  return 0;
+}
+
+static const struct trace_record *replay_record(uint32_t i)
+{
+  return &replay_ring[(replay_first + i) % replay_hdr->nrecords];
+}
+
+static void replay_dispatch(const struct trace_record *r)
+{
+  snd_seq_event_t ev = r->ev;
+
+  if (ev.source.client == SND_SEQ_CLIENT_SYSTEM)
+    return;
+
+  if (snd_seq_ev_is_variable(&ev))
+    ev.data.ext.ptr = (void *) r->data;
+
+  handle_event(&ev);
+  stat_replay_events++;
+}
+
+static void replay_finish(void)
+{
+  replay_end = now_ns();
+  replay_done = 1;
+}
+
+/*
+ * Dispatch every event that is due and wait for the next one.
+ */
+
+static void replay_expired(struct timer *tm)
+{
+  uint64_t now = now_ns();
+  uint64_t t0 = replay_record(0)->time;
+
+  while (cursor < replay_count) {
+    const struct trace_record *r = replay_record(cursor);
+
+    if (replay_start + (r->time - t0) > now) {
+      timer_add_ns(&replay_timer, replay_start + (r->time - t0));
+      return;
+    }
+
+    replay_dispatch(r);
+    cursor++;
+  }
+
+  replay_finish();
+}
+
+void replay_start_now(void)
+{
+  timer_init(&replay_timer, replay_expired);
+  cursor = 0;
+  replay_start = now_ns();
+
+  if (replay_count == 0) {
+    replay_finish();
+    return;
+  }
+
+  if (!replay_fast)
+    replay_expired(&replay_timer);
+}
+
+/*
+ * Does the main loop have to come back without waiting?
+ */
+
+int replay_pending(void)
+{
+  return replay_fast && !replay_done;
+}
+
+/*
+ * In fast mode, dispatch the next event.  Called once per iteration of
+ * the main loop, before the commit.
+ */
+
+void replay_step(void)
+{
+  if (!replay_pending())
+    return;
+
+  // the writer thread is behind and the last commit is still waiting
+  if (!outset_empty(&out_dirty))
+    return;
+
+  if (cursor < replay_count)
+    replay_dispatch(replay_record(cursor++));
+  if (cursor == replay_count)
+    replay_finish();
+}
+
+double replay_seconds(void)
+{
+  return ((replay_done ? replay_end : now_ns()) - replay_start) / 1e9;
+}
@@ -0,0 +1,389 @@
+/*
+ * MIDI2GPIOD
+ *
+ * Standard MIDI File playback.
+ *
+ * With `--play FILE` the program plays a .mid file straight to the
+ * outputs, for installations that run unattended without a sequencer.
+ * The file is mapped into memory and parsed once at startup: the events
+ * of all tracks are merged, sorted by time, converted from ticks to
+ * nanoseconds through the tempo map, and the notes that no mapping
+ * listens to are dropped.  What remains is a flat array that playback
+ * walks with a cursor.
+ *
+ * Every event is scheduled at an absolute deadline from the start of
+ * playback, so timer latency never accumulates into drift.  Events are
+ * dispatched through handle_event(), the same path as live input.
+ *
+ * McLaren Labs
+ * 2021
+ *
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "midi2gpiod.h"
+
+char *play_file = NULL;
+int play_loop = 0;
+int play_done = 0;
+
+struct smf_event {
+  uint64_t	time;		// ticks while parsing, then ns
+  uint32_t	seq;		// order in the file, to keep the sort stable
+  uint32_t	tempo;		// tempo events: us per quarter note
+  unsigned char	type;		// SND_SEQ_EVENT_NOTEON, NOTEOFF or TEMPO
+  unsigned char	channel;
+  unsigned char	note;
+  unsigned char	velocity;
+};
+
+static struct smf_event *events;
+static int nevents;
+static int events_size;
+static uint64_t play_length;	// ns from the start to the end of the longest track
+
+static int cursor;
+static uint64_t play_start;
+static struct timer play_timer;
+
+unsigned long stat_play_events;
+unsigned long stat_play_loops;
+
+static int smf_push(uint64_t tick, unsigned char type, int channel, int note, int velocity, uint32_t tempo)
+{
+  struct smf_event *e;
+
+  if (nevents == events_size) {
+    int size = events_size ? events_size * 2 : 1024;
+    struct smf_event *p = realloc(events, size * sizeof(*p));
+    if (!p) {
+      perror("smf");
+      return -1;
+    }
+    events = p;
+    events_size = size;
+  }
+
+  e = &events[nevents];
+  e->time = tick;
+  e->seq = nevents++;
+  e->type = type;
+  e->channel = channel;
+  e->note = note;
+  e->velocity = velocity;
+  e->tempo = tempo;
+  return 0;
+}
+
+static uint32_t be32(const unsigned char *p)
+{
+  return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/*
+ * Read a variable-length quantity.  Returns -1 if it runs past `end`.
+ */
+
+static int smf_vlq(const unsigned char **pp, const unsigned char *end, uint32_t *val)
+{
+  const unsigned char *p = *pp;
+  uint32_t v = 0;
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    if (p >= end)
+      return -1;
+    v = (v << 7) | (*p & 0x7f);
+    if (!(*p++ & 0x80)) {
+      *val = v;
+      *pp = p;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Parse one MTrk chunk.  Returns the tick of its end, or -1 on error.
+ */
+
+static int64_t smf_track(const unsigned char *p, const unsigned char *end)
+{
+  uint64_t tick = 0;
+  int status = 0;
+  uint32_t delta, len;
+
+  while (p < end) {
+    if (smf_vlq(&p, end, &delta) < 0 || p >= end)
+      return -1;
+    tick += delta;
+
+    if (*p & 0x80)
+      status = *p++;
+    else if (status == 0)
+      return -1;			// running status with no status
+    if (status < 0xf0 && p + ((status & 0xe0) == 0xc0 ? 1 : 2) > end)
+      return -1;
+
+    switch (status & 0xf0) {
+
+    case 0x80:
+      if (smf_push(tick, SND_SEQ_EVENT_NOTEOFF, status & 15, p[0], p[1], 0) < 0)
+	return -1;
+      p += 2;
+      break;
+
+    case 0x90:
+      if (smf_push(tick, p[1] ? SND_SEQ_EVENT_NOTEON : SND_SEQ_EVENT_NOTEOFF,
+		   status & 15, p[0], p[1], 0) < 0)
+	return -1;
+      p += 2;
+      break;
+
+    case 0xa0:
+    case 0xb0:
+    case 0xe0:
+      p += 2;
+      break;
+
+    case 0xc0:
+    case 0xd0:
+      p += 1;
+      break;
+
+    case 0xf0:
+      if (status == 0xff) {
+	// meta event: type, length, data
+	int type;
+	if (p >= end)
+	  return -1;
+	type = *p++;
+	if (smf_vlq(&p, end, &len) < 0 || p + len > end)
+	  return -1;
+	if (type == 0x51 && len == 3) {
+	  if (smf_push(tick, SND_SEQ_EVENT_TEMPO, 0, 0, 0,
+		       (uint32_t) p[0] << 16 | p[1] << 8 | p[2]) < 0)
+	    return -1;
+	}
+	p += len;
+	if (type == 0x2f)
+	  return tick;			// end of track
+      }
+      else if (status == 0xf0 || status == 0xf7) {
+	if (smf_vlq(&p, end, &len) < 0 || p + len > end)
+	  return -1;
+	p += len;
+      }
+      else
+	return -1;
+      status = 0;			// meta and sysex cancel running status
+      break;
+    }
+  }
+
+  return tick;
+}
+
+static int smf_cmp(const void *a, const void *b)
+{
+  const struct smf_event *x = a, *y = b;
+
+  if (x->time != y->time)
+    return x->time < y->time ? -1 : 1;
+  return x->seq < y->seq ? -1 : 1;
+}
+
+/*
+ * Does any mapping listen to this note?
+ */
+
+static int smf_mapped(const struct smf_event *e)
+{
+  struct mapping *m;
+
+  for (m = note_map[e->note & 0x7f]; m; m = m->next)
+    if (m->channel < 0 || m->channel == e->channel)
+      return 1;
+  return 0;
+}
+
+/*
+ * Convert the merged events from ticks to ns along the tempo map, and
+ * keep only the notes that drive something.
+ */
+
+static void smf_resolve(int division, uint64_t end_tick)
+{
+  uint64_t tick = 0, ns = 0;
+  double tick_ns;
+  int i, n = 0;
+
+  if (division & 0x8000) {
+    // SMPTE: frames per second and ticks per frame, no tempo
+    int fps = -(signed char) (division >> 8);
+    tick_ns = 1e9 / (fps * (division & 0xff));
+  }
+  else
+    tick_ns = 500000.0 * 1000 / division;	// 120 bpm until told otherwise
+
+  for (i = 0; i < nevents; i++) {
+    struct smf_event *e = &events[i];
+
+    ns += (uint64_t) ((e->time - tick) * tick_ns);
+    tick = e->time;
+
+    if (e->type == SND_SEQ_EVENT_TEMPO) {
+      if (!(division & 0x8000) && e->tempo)
+	tick_ns = e->tempo * 1000.0 / division;
+      continue;
+    }
+
+    if (!smf_mapped(e))
+      continue;
+
+    e->time = ns;
+    events[n++] = *e;
+  }
+
+  play_length = ns + (uint64_t) ((end_tick > tick ? end_tick - tick : 0) * tick_ns);
+  nevents = n;
+}
+
+/*
+ * Map and parse `path`.  Returns 0 on success.
+ */
+
+int smf_load(const char *path)
+{
+  const unsigned char *data, *p, *end;
+  struct stat st;
+  int fd, ntracks, division, t;
+  int64_t end_tick = 0, track_end;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    perror(path);
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror(path);
+    return -1;
+  }
+
+  end = data + st.st_size;
+  if (st.st_size < 14 || memcmp(data, "MThd", 4) != 0 || be32(data + 4) < 6) {
+    fprintf(stderr, "%s: not a Standard MIDI File\n", path);
+    goto fail;
+  }
+
+  ntracks = data[10] << 8 | data[11];
+  division = data[12] << 8 | data[13];
+  if (division == 0 || ((division & 0x8000) &&
+			((signed char) (division >> 8) >= 0 || (division & 0xff) == 0))) {
+    fprintf(stderr, "%s: bad division\n", path);
+    goto fail;
+  }
+
+  p = data + 8 + be32(data + 4);
+  for (t = 0; t < ntracks && p + 8 <= end; ) {
+    uint32_t len = be32(p + 4);
+
+    if ((uint64_t) (end - p - 8) < len) {
+      fprintf(stderr, "%s: truncated chunk\n", path);
+      goto fail;
+    }
+
+    // skip chunks of unknown type
+    if (memcmp(p, "MTrk", 4) == 0) {
+      track_end = smf_track(p + 8, p + 8 + len);
+      if (track_end < 0) {
+	fprintf(stderr, "%s: bad track %d\n", path, t);
+	goto fail;
+      }
+      if (track_end > end_tick)
+	end_tick = track_end;
+      t++;
+    }
+    p += 8 + len;
+  }
+
+  munmap((void *) data, st.st_size);
+
+  qsort(events, nevents, sizeof(*events), smf_cmp);
+  smf_resolve(division, end_tick);
+
+  if (verbose)
+    printf("Loaded %s: %d tracks, %d events, %.1f s\n", path, t, nevents,
+	   play_length / 1e9);
+  return 0;
+
+ fail:
+  munmap((void *) data, st.st_size);
+  return -1;
+}
+
+/*
+ * Dispatch every event that is due and wait for the next one.
+ */
+
+static void play_expired(struct timer *tm)
+{
+  uint64_t now = now_ns();
+
+  for (;;) {
+    if (cursor == nevents) {
+      if (!play_loop || play_length == 0) {
+	// the file ends at the end of its longest track, not its last note
+	if (play_start + play_length > now) {
+	  timer_add_ns(&play_timer, play_start + play_length);
+	  return;
+	}
+	play_done = 1;
+	return;
+      }
+      // the next pass starts where this one ends, not where we are now
+      cursor = 0;
+      play_start += play_length;
+      stat_play_loops++;
+    }
+
+    const struct smf_event *e = &events[cursor];
+    if (play_start + e->time > now) {
+      timer_add_ns(&play_timer, play_start + e->time);
+      return;
+    }
+
+    snd_seq_event_t ev;
+    snd_seq_ev_clear(&ev);
+    ev.type = e->type;
+    ev.data.note.channel = e->channel;
+    ev.data.note.note = e->note;
+    ev.data.note.velocity = e->velocity;
+    handle_event(&ev);
+
+    stat_play_events++;
+    cursor++;
+  }
+}
+
+void play_start_now(void)
+{
+  timer_init(&play_timer, play_expired);
+  cursor = 0;
+  play_start = now_ns();
+
+  if (nevents == 0) {
+    play_done = 1;
+    return;
+  }
+
+  play_expired(&play_timer);
+}
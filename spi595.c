@@ -0,0 +1,201 @@
+/*
+ * MIDI2GPIOD
+ *
+ * 74HC595 shift register backend.
+ *
+ * A chain of 74HC595 shift registers on a spidev bus gives eight
+ * outputs per register, hundreds per chain.  The state of the whole
+ * chain is kept as a frame of bytes, and a commit that changes it sends
+ * the frame in one SPI transfer; the registers latch it when chip
+ * select rises (RCLK wired to CS), so all the outputs change at once.
+ *
+ *   chip wall 74hc595 /dev/spidev0.0 speed=4000000
+ *   output relay1 wall 0		# Q0 of the first register
+ *   output relay9 wall 8		# Q0 of the second
+ *
+ * Line N is output Q(N % 8) of register N / 8, the first register being
+ * the one wired to MOSI.  The chain is as long as the highest line
+ * needs, or `length=` registers.
+ *
+ * If the device is not a spidev (a file, a pipe or a pty), the frame is
+ * written to it instead, so a configuration can be tried without the
+ * hardware.
+ *
+ * McLaren Labs
+ * 2021
+ *
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+#include "midi2gpiod.h"
+
+#define SPI595_MAX	(MAX_OUTPUTS / 8)	// registers in a chain
+
+struct spi595 {
+  int		fd;
+  int		spidev;		// 0 if the device is a stand-in
+  uint32_t	speed;
+  int		length;		// registers
+  unsigned char	frame[SPI595_MAX];
+  unsigned char	sent[SPI595_MAX];
+  int		valid;		// `sent` holds what the chain has
+};
+
+static struct spi595 *spi595_priv(struct out_chip *ch)
+{
+  if (!ch->priv) {
+    struct spi595 *s = calloc(1, sizeof(*s));
+    if (!s)
+      return NULL;
+    s->fd = -1;
+    s->speed = 1000000;
+    ch->priv = s;
+  }
+  return ch->priv;
+}
+
+static int spi595_setting(struct out_chip *ch, const char *key, const char *val)
+{
+  struct spi595 *s = spi595_priv(ch);
+  char *end;
+  long v;
+
+  if (!s)
+    return -1;
+
+  v = strtol(val, &end, 0);
+  if (*val == '\0' || *end != '\0')
+    return -1;
+
+  if (strcmp(key, "speed") == 0 && v >= 1000 && v <= 100000000)
+    s->speed = v;
+  else if (strcmp(key, "length") == 0 && v >= 1 && v <= SPI595_MAX)
+    s->length = v;
+  else
+    return -1;
+  return 0;
+}
+
+static int spi595_write(struct out_chip *ch, const struct outset *state)
+{
+  struct spi595 *s = ch->priv;
+  struct spi_ioc_transfer xfer;
+  int i, ret;
+
+  memset(s->frame, 0, s->length);
+  for (i = 0; i < ch->nouts; i++) {
+    unsigned int line = outputs[ch->outs[i]].offset;
+    if (outset_test(state, ch->outs[i]))
+      // the last byte shifted in stays in the first register
+      s->frame[s->length - 1 - line / 8] |= 1 << (line % 8);
+  }
+
+  if (s->valid && memcmp(s->frame, s->sent, s->length) == 0)
+    return 0;
+
+  if (s->spidev) {
+    memset(&xfer, 0, sizeof(xfer));
+    xfer.tx_buf = (unsigned long) s->frame;
+    xfer.len = s->length;
+    xfer.speed_hz = s->speed;
+    xfer.bits_per_word = 8;
+    ret = ioctl(s->fd, SPI_IOC_MESSAGE(1), &xfer);
+  }
+  else
+    ret = write(s->fd, s->frame, s->length);
+
+  if (ret < 0) {
+    fprintf(stderr, "Write chip '%s' failed: %s\n", ch->name, strerror(errno));
+    s->valid = 0;
+    return -1;
+  }
+
+  memcpy(s->sent, s->frame, s->length);
+  s->valid = 1;
+  return 0;
+}
+
+/*
+ * Open the bus and load the chain with the initial state.  Returns 1
+ * on success.
+ */
+
+static int spi595_open(struct out_chip *ch)
+{
+  struct spi595 *s = spi595_priv(ch);
+  uint8_t mode = SPI_MODE_0, bits = 8;
+  int i, need = 0;
+
+  if (!s) {
+    perror("74hc595");
+    return 0;
+  }
+
+  if (!ch->path) {
+    fprintf(stderr, "Chip '%s' needs a device\n", ch->name);
+    return 0;
+  }
+
+  for (i = 0; i < ch->nouts; i++) {
+    int regs = outputs[ch->outs[i]].offset / 8 + 1;
+    if (regs > need)
+      need = regs;
+  }
+  if (need > SPI595_MAX || (s->length && need > s->length)) {
+    fprintf(stderr, "Chip '%s' is too short for line %d\n", ch->name, need * 8 - 1);
+    return 0;
+  }
+  if (!s->length)
+    s->length = need;
+
+  s->fd = open(ch->path, O_RDWR | O_CLOEXEC);
+  if (s->fd < 0) {
+    fprintf(stderr, "Open chip '%s' (%s) failed: %s\n", ch->name, ch->path, strerror(errno));
+    return 0;
+  }
+
+  s->spidev = ioctl(s->fd, SPI_IOC_WR_MODE, &mode) == 0;
+  if (s->spidev) {
+    if (ioctl(s->fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0 ||
+	ioctl(s->fd, SPI_IOC_WR_MAX_SPEED_HZ, &s->speed) < 0) {
+      fprintf(stderr, "Configure chip '%s' failed: %s\n", ch->name, strerror(errno));
+      close(s->fd);
+      s->fd = -1;
+      return 0;
+    }
+  }
+  else if (verbose)
+    printf("Chip '%s': %s is not a spidev, writing frames to it\n", ch->name, ch->path);
+
+  s->valid = 0;
+  if (spi595_write(ch, &out_state) < 0) {
+    close(s->fd);
+    s->fd = -1;
+    return 0;
+  }
+  return 1;
+}
+
+/*
+ * Close the bus.  The settings stay, for when the chip is opened again.
+ */
+
+static void spi595_close(struct out_chip *ch)
+{
+  struct spi595 *s = ch->priv;
+
+  close(s->fd);
+  s->fd = -1;
+}
+
+const struct chip_ops spi595_ops = {
+  .type		= "74hc595",
+  .max_lines	= MAX_OUTPUTS,
+  .setting	= spi595_setting,
+  .open		= spi595_open,
+  .write	= spi595_write,
+  .close	= spi595_close,
+};
@@ -0,0 +1,154 @@
+/*
+ * MIDI2GPIOD
+ *
+ * Startup.
+ *
+ * Setting up the sequencer client and opening the output chips do not
+ * depend on each other, and at boot either can be slow: the sequencer
+ * may not be loaded yet, and I2C expanders take a while to answer.  The
+ * sequencer is set up on a thread of its own while the main thread
+ * opens the chips and requests the input lines.
+ *
+ * A phase that fails is tried again after a delay that doubles from
+ * 100 ms up to 5 s, for up to a minute, rather than giving up at once
+ * on a device that is not there yet.  The time every phase took is
+ * logged, and systemd is told we are ready as soon as events can flow
+ * from the source to the outputs.
+ *
+ * McLaren Labs
+ * 2021
+ *
+ */
+
+#include <pthread.h>
+#include <time.h>
+#include "midi2gpiod.h"
+
+#define RETRY_FIRST_MS		100
+#define RETRY_MAX_MS		5000
+#define RETRY_GIVE_UP_MS	60000
+
+struct phase {
+  const char	*name;
+  int		(*setup)(void);		// 0 on success
+  void		(*undo)(void);		// after a failed setup, or NULL
+  int		err;
+  int		tries;
+  uint64_t	ns;			// time taken, retries included
+};
+
+static int outputs_setup(void)
+{
+  return gpio_setup() == 1 ? 0 : -1;
+}
+
+static int inputs_setup(void)
+{
+  return input_setup() == 1 ? 0 : -1;
+}
+
+static struct phase seq_phase = {
+  .name		= "sequencer",
+  .setup	= seq_setup,
+};
+
+static struct phase out_phase = {
+  .name		= "outputs",
+  .setup	= outputs_setup,
+};
+
+static struct phase in_phase = {
+  .name		= "inputs",
+  .setup	= inputs_setup,
+  .undo		= input_release,
+};
+
+/*
+ * Run a phase until it succeeds or it is time to give up.
+ */
+
+static void phase_run(struct phase *p)
+{
+  uint64_t start = now_ns();
+  unsigned int delay = RETRY_FIRST_MS;
+
+  for (;;) {
+    p->tries++;
+    p->err = p->setup();
+    if (p->err >= 0 ||
+	now_ns() - start + delay * 1000000ULL > RETRY_GIVE_UP_MS * 1000000ULL)
+      break;
+
+    if (p->undo)
+      p->undo();
+    fprintf(stderr, "Setting up the %s failed, trying again in %u ms\n", p->name, delay);
+
+    struct timespec ts = { delay / 1000, (delay % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+    delay = delay * 2 < RETRY_MAX_MS ? delay * 2 : RETRY_MAX_MS;
+  }
+
+  p->ns = now_ns() - start;
+}
+
+static void *seq_thread(void *arg)
+{
+  phase_run(arg);
+  return NULL;
+}
+
+static void phase_log(const struct phase *p)
+{
+  printf(", %s %.1f ms", p->name, p->ns / 1e6);
+  if (p->tries > 1)
+    printf(" (%d tries)", p->tries);
+}
+
+/*
+ * Set up the sequencer, the outputs and the inputs.  Returns 0, or -1
+ * if one of them could not be set up.
+ */
+
+int startup(void)
+{
+  uint64_t start = now_ns();
+  pthread_t thread;
+  int threaded;
+
+  // the outputs start from the state file, read before they are opened
+  if (state_file && state_open(state_file) < 0)
+    return -1;
+
+  threaded = pthread_create(&thread, NULL, seq_thread, &seq_phase) == 0;
+  if (!threaded)
+    phase_run(&seq_phase);
+
+  phase_run(&out_phase);
+  if (out_phase.err < 0) {
+    fprintf(stderr, "GPIO configuration failed\n");
+    return -1;
+  }
+
+  phase_run(&in_phase);
+  if (in_phase.err < 0) {
+    fprintf(stderr, "GPIO input configuration failed\n");
+    return -1;
+  }
+
+  if (threaded)
+    pthread_join(thread, NULL);
+  if (seq_phase.err < 0) {
+    fprintf(stderr, "Sequencer setup failed\n");
+    return -1;
+  }
+
+  // events can flow from here on
+  notify_ready();
+
+  printf("Started in %.1f ms", (now_ns() - start) / 1e6);
+  phase_log(&seq_phase);
+  phase_log(&out_phase);
+  phase_log(&in_phase);
+  printf("\n");
+  return 0;
+}
@@ -0,0 +1,175 @@
+/*
+ * MIDI2GPIOD
+ *
+ * Output state file.
+ *
+ * With `--state FILE` the value of every output is mirrored to a small
+ * file mapped into memory.  Every commit stores the new values into the
+ * mapping, which costs a few stores and no system call; the kernel
+ * writes the page back, and it survives a crash of the program.
+ *
+ * At startup the values are read back and become the initial values of
+ * the line requests, so when the service is restarted after a crash the
+ * relays that were on stay on instead of blinking off.  The file is
+ * only used if it was written with the same outputs (names, chips and
+ * lines); after a change of configuration everything starts off.
+ *
+ * A restored output with a hold mapping is on as if its note were held,
+ * and the next Note-Off releases it.  Outputs that only pulse are not
+ * restored: a pulse cut short by the crash must not become a latch.
+ * The file holds the values the mappings drive, without the outputs
+ * forced through the control socket: a force is an operator's override
+ * for the running program, and a restart ends it.
+ *
+ * McLaren Labs
+ * 2021
+ *
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "midi2gpiod.h"
+
+#define STATE_MAGIC	"M2GSTATE"
+#define STATE_VERSION	1
+#define STATE_SIZE	4096
+
+struct state_file {
+  char		magic[8];
+  uint32_t	version;
+  uint32_t	noutputs;
+  uint64_t	signature;	// of the outputs, see state_signature()
+  struct outset	values;
+};
+
+char *state_file = NULL;
+
+static struct state_file *state;
+
+static uint64_t fnv(uint64_t h, const void *p, size_t len)
+{
+  const unsigned char *s = p;
+
+  while (len--)
+    h = (h ^ *s++) * 1099511628211ULL;
+  return h;
+}
+
+static uint64_t state_signature(void)
+{
+  uint64_t h = 14695981039346656037ULL;
+  int o;
+
+  for (o = 0; o < noutputs; o++) {
+    h = fnv(h, outputs[o].name, strlen(outputs[o].name) + 1);
+    h = fnv(h, chips[outputs[o].chip].name, strlen(chips[outputs[o].chip].name) + 1);
+    h = fnv(h, &outputs[o].offset, sizeof(outputs[o].offset));
+  }
+  return h;
+}
+
+/*
+ * Turn on a restored output, through one of its hold mappings if it
+ * has any, with its maximum on-time counted from now.  Returns 0 if it
+ * has none.
+ */
+
+static int state_restore(int o)
+{
+  int i;
+
+  for (i = 0; i < nmappings; i++) {
+    struct mapping *m = &mappings[i];
+
+    if (m->out == o && m->mode == MAP_HOLD) {
+      m->active = 1;
+      if (m->maxhold)
+	timer_add(&m->hold_timer, m->maxhold);
+      outputs[o].holds++;
+      output_set(o, 1);
+      return 1;
+    }
+  }
+
+  for (i = 0; i < nmappings; i++)
+    if (mappings[i].out == o && mappings[i].mode == MAP_PULSE)
+      return 0;
+
+  // driven by cues, generators, patterns or controllers
+  output_set(o, 1);
+  return 1;
+}
+
+/*
+ * Map the state file, creating it if needed, and restore the outputs
+ * from it.  Must be called after the configuration is loaded and before
+ * gpio_setup().  Returns 0 on success.
+ */
+
+int state_open(const char *path)
+{
+  uint64_t sig = state_signature();
+  int fd, o, restored = 0;
+
+  fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    perror(path);
+    return -1;
+  }
+
+  if (ftruncate(fd, STATE_SIZE) < 0) {
+    perror(path);
+    close(fd);
+    return -1;
+  }
+
+  state = mmap(NULL, STATE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (state == MAP_FAILED) {
+    perror(path);
+    state = NULL;
+    return -1;
+  }
+
+  if (memcmp(state->magic, STATE_MAGIC, sizeof(state->magic)) == 0 &&
+      state->version == STATE_VERSION && state->noutputs == (uint32_t) noutputs &&
+      state->signature == sig) {
+    for (o = 0; o < noutputs; o++)
+      if (outset_test(&state->values, o))
+	restored += state_restore(o);
+  }
+  else if (verbose)
+    printf("State file %s does not match the outputs, starting with all off\n", path);
+
+  memcpy(state->magic, STATE_MAGIC, sizeof(state->magic));
+  state->version = STATE_VERSION;
+  state->noutputs = noutputs;
+  state->signature = sig;
+  state->values = out_state;
+
+  output_sync();
+
+  if (verbose && restored)
+    printf("Restored %d outputs from %s\n", restored, path);
+  return 0;
+}
+
+/*
+ * Record the values just committed, before forces are applied.
+ */
+
+void state_save(const struct outset *values)
+{
+  if (state)
+    state->values = *values;
+}
+
+void state_close(void)
+{
+  if (!state)
+    return;
+  msync(state, STATE_SIZE, MS_ASYNC);
+  munmap(state, STATE_SIZE);
+  state = NULL;
+}
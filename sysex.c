@@ -0,0 +1,95 @@
+/*
+ * MIDI2GPIOD
+ *
+ * SysEx bulk state.
+ *
+ * One System Exclusive message sets any number of outputs at once, so a
+ * scene of 64 relays is one message on the wire instead of 64 notes:
+ *
+ *   F0 7D 4D 32 01 <state> F7			set the outputs in the bitmap
+ *   F0 7D 4D 32 02 <state> <mask> F7		set only those in the mask
+ *
+ * 7D is the manufacturer ID for non-commercial use, and 4D 32 is "M2".
+ * The bitmap carries 7 outputs per data byte, in configuration order:
+ * output i is bit (i % 7) of byte (i / 7).  A bitmap of n bytes covers
+ * the first 7n outputs and leaves the others as they are.  With command
+ * 02 the state is followed by a mask of the same length, and only the
+ * outputs whose mask bit is set are changed.
+ *
+ * The message is decoded straight from the event's buffer into a set
+ * and a clear mask, and applied word-wise to the shadow state, so the
+ * whole scene goes out in the commit of the batch, one write per chip.
+ * Like a pattern step, it sets the outputs regardless of the notes that
+ * hold them.
+ *
+ * McLaren Labs
+ * 2021
+ *
+ */
+
+#include "midi2gpiod.h"
+
+#define SYSEX_HEADER		5	// F0 7D 4D 32 cmd
+#define SYSEX_STATE		0x01
+#define SYSEX_STATE_MASK	0x02
+
+unsigned long stat_sysex_states;
+
+static const unsigned char sysex_id[] = { 0xf0, 0x7d, 0x4d, 0x32 };
+
+/*
+ * Returns 1 if `buf` was a bulk state message, 0 if it is not ours.
+ */
+
+int sysex_bulk_state(const unsigned char *buf, unsigned int len)
+{
+  struct outset set, clear;
+  const unsigned char *state, *mask = NULL;
+  unsigned int n, i;
+  int o;
+
+  if (len < SYSEX_HEADER + 1 || memcmp(buf, sysex_id, sizeof(sysex_id)) != 0 ||
+      buf[len - 1] != 0xf7)
+    return 0;
+
+  n = len - SYSEX_HEADER - 1;
+  state = buf + SYSEX_HEADER;
+
+  switch (buf[4]) {
+  case SYSEX_STATE:
+    break;
+  case SYSEX_STATE_MASK:
+    if (n & 1)
+      return 0;
+    n /= 2;
+    mask = state + n;
+    break;
+  default:
+    return 0;
+  }
+
+  memset(&set, 0, sizeof(set));
+  memset(&clear, 0, sizeof(clear));
+
+  for (i = 0, o = 0; i < n && o < noutputs; i++) {
+    unsigned int bits = state[i];
+    unsigned int care = mask ? mask[i] : 0x7f;
+    int b;
+
+    for (b = 0; b < 7 && o < noutputs; b++, o++) {
+      if (!(care & (1 << b)))
+	continue;
+      if (bits & (1 << b))
+	outset_set(&set, o);
+      else
+	outset_set(&clear, o);
+    }
+  }
+
+  output_apply(&set, &clear);
+  stat_sysex_states++;
+
+  if (verbose)
+    printf("SysEx state for %d outputs\n", o);
+  return 1;
+}
@@ -0,0 +1,136 @@
+/*
+ * MIDI2GPIOD
+ *
+ * Thru.
+ *
+ * With `--thru` the events received on our port are sent on to the
+ * clients subscribed to it, so that midi2gpiod can sit in the middle of
+ * a chain.  `--thru=mapped` only passes on the notes and controllers
+ * that drive an output, `--thru=unmapped` only the events that do not,
+ * which lets a following synth play the notes the relays leave alone.
+ *
+ * The events are queued in the output buffer of the sequencer with
+ * snd_seq_event_output_buffer(), which is a copy and no system call,
+ * and the whole batch goes to the kernel with one snd_seq_drain_output()
+ * at the end of the main loop iteration.
+ *
+ * McLaren Labs
+ * 2021
+ *
+ */
+
+#include "midi2gpiod.h"
+
+int thru_mode = THRU_OFF;
+
+unsigned long stat_thru_events;
+unsigned long stat_seq_drains;
+unsigned long stat_seq_dropped;
+
+static int seq_pending;		// events in the output buffer
+
+int thru_parse(const char *s)
+{
+  if (!s || strcmp(s, "all") == 0)
+    thru_mode = THRU_ALL;
+  else if (strcmp(s, "mapped") == 0)
+    thru_mode = THRU_MAPPED;
+  else if (strcmp(s, "unmapped") == 0)
+    thru_mode = THRU_UNMAPPED;
+  else {
+    fprintf(stderr, "Unknown thru mode '%s'\n", s);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Queue `ev`, with its destination set, in the output buffer.  When the
+ * buffer is full it is drained first; when the kernel does not take it
+ * either, the event is dropped rather than waited for.
+ */
+
+int seq_output(snd_seq_event_t *ev)
+{
+  int err;
+
+  snd_seq_ev_set_source(ev, seq_port0);
+  snd_seq_ev_set_direct(ev);
+
+  err = snd_seq_event_output_buffer(seq, ev);
+  if (err == -EAGAIN) {
+    seq_flush();
+    err = snd_seq_event_output_buffer(seq, ev);
+  }
+  if (err < 0) {
+    stat_seq_dropped++;
+    return err;
+  }
+
+  seq_pending = 1;
+  return 0;
+}
+
+/*
+ * Send the buffered events, once per batch.
+ */
+
+void seq_flush(void)
+{
+  if (!seq_pending)
+    return;
+
+  // nonblocking: what the kernel cannot take now stays in the buffer
+  if (snd_seq_drain_output(seq) == 0)
+    seq_pending = 0;
+  stat_seq_drains++;
+}
+
+/*
+ * Does a mapping listen to this note or controller?
+ */
+
+static int thru_mapped(const snd_seq_event_t *ev)
+{
+  struct mapping *m;
+  int channel;
+
+  switch (ev->type) {
+  case SND_SEQ_EVENT_NOTEON:
+  case SND_SEQ_EVENT_NOTEOFF:
+    m = note_map[ev->data.note.note & 0x7f];
+    channel = ev->data.note.channel;
+    break;
+  case SND_SEQ_EVENT_CONTROLLER:
+    m = cc_map[ev->data.control.param & 0x7f];
+    channel = ev->data.control.channel;
+    break;
+  default:
+    return 0;
+  }
+
+  for (; m; m = m->next)
+    if (m->channel < 0 || m->channel == channel)
+      return 1;
+  return 0;
+}
+
+/*
+ * An event was received and handled; pass it on if the mode says so.
+ * The event is changed in place, it is not needed after this.
+ */
+
+void thru_event(snd_seq_event_t *ev)
+{
+  // never echo our own events, should our port be connected to itself
+  if (ev->source.client == seq_client)
+    return;
+
+  if (thru_mode != THRU_ALL &&
+      thru_mapped(ev) != (thru_mode == THRU_MAPPED))
+    return;
+
+  snd_seq_ev_set_subs(ev);
+  if (seq_output(ev) == 0)
+    stat_thru_events++;
+}
@@ -0,0 +1,312 @@
+/*
+ * MIDI2GPIOD
+ *
+ * A hierarchical timer wheel driven by a timerfd.
+ *
+ * The wheel has four levels of 64 slots each.  Level 0 holds timers
+ * expiring in the next 64 ticks, level 1 the next 64*64 ticks and so
+ * on.  Whenever level 0 wraps around, the next slot of level 1 is
+ * cascaded down, and so on up the levels.  This is the classic design
+ * of the Linux kernel timer wheel: insert and delete are O(1), and
+ * expiry touches only the timers that are due.
+ *
+ * The timerfd is armed with an absolute deadline for the next tick
+ * that has work to do, so an idle wheel never wakes the program.
+ *
+ * McLaren Labs
+ * 2021
+ *
+ */
+
+#include <unistd.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include "midi2gpiod.h"
+
+#define WHEEL_BITS	6
+#define WHEEL_SIZE	(1 << WHEEL_BITS)
+#define WHEEL_MASK	(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS	4
+
+#define LEVEL_SHIFT(n)	((n) * WHEEL_BITS)
+#define LEVEL_INDEX(t, n) (((t) >> LEVEL_SHIFT(n)) & WHEEL_MASK)
+
+static struct timer wheel[WHEEL_LEVELS][WHEEL_SIZE];	// list heads
+
+static uint64_t wheel_base_ns;	// monotonic time of tick 0
+static uint64_t wheel_now;	// next tick to be processed
+static int	wheel_pending;	// number of timers in the wheel
+static int	wheel_fd = -1;
+static int	wheel_is_armed;
+static uint64_t wheel_armed;	// tick the timerfd is armed for
+
+uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Return the current tick of the wheel clock.
+ */
+
+uint64_t timers_now(void)
+{
+  return (now_ns() - wheel_base_ns) / TIMER_TICK_NS;
+}
+
+void timer_init(struct timer *t, void (*fn)(struct timer *t))
+{
+  t->next = NULL;
+  t->prev = NULL;
+  t->expires = 0;
+  t->fn = fn;
+}
+
+int timer_pending(const struct timer *t)
+{
+  return t->next != NULL;
+}
+
+static void list_add_tail(struct timer *head, struct timer *t)
+{
+  t->next = head;
+  t->prev = head->prev;
+  head->prev->next = t;
+  head->prev = t;
+}
+
+static void list_unlink(struct timer *t)
+{
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->next = NULL;
+  t->prev = NULL;
+}
+
+/*
+ * Place a timer in the slot of the level that covers its distance from
+ * the current tick.  Timers already in the past go to the current slot
+ * and run on the next tick; timers beyond the range of the wheel are
+ * clamped to its far end and cascade down until they are due.
+ */
+
+static void wheel_insert(struct timer *t)
+{
+  uint64_t expires = t->expires;
+  int64_t delta = (int64_t) (expires - wheel_now);
+  int level;
+
+  if (delta < 0) {
+    list_add_tail(&wheel[0][wheel_now & WHEEL_MASK], t);
+    return;
+  }
+
+  for (level = 0; level < WHEEL_LEVELS; level++) {
+    if (delta < (1LL << LEVEL_SHIFT(level + 1))) {
+      list_add_tail(&wheel[level][LEVEL_INDEX(expires, level)], t);
+      return;
+    }
+  }
+
+  expires = wheel_now + (1ULL << LEVEL_SHIFT(WHEEL_LEVELS)) - 1;
+  list_add_tail(&wheel[WHEEL_LEVELS - 1][LEVEL_INDEX(expires, WHEEL_LEVELS - 1)], t);
+}
+
+/*
+ * Arm or re-arm a timer to fire `ms` milliseconds from now.  Re-arming a
+ * pending timer just moves it to its new slot.
+ */
+
+static void timer_add_tick(struct timer *t, uint64_t expires)
+{
+  if (timer_pending(t))
+    list_unlink(t);
+  else if (wheel_pending++ == 0)
+    wheel_now = timers_now();	// an empty wheel can skip ahead
+
+  t->expires = expires;
+  wheel_insert(t);
+}
+
+void timer_add(struct timer *t, unsigned int ms)
+{
+  timer_add_tick(t, timers_now() + ms);
+}
+
+/*
+ * Arm a timer for an absolute CLOCK_MONOTONIC time, rounded up to the
+ * next tick.
+ */
+
+void timer_add_ns(struct timer *t, uint64_t when_ns)
+{
+  uint64_t tick = 0;
+
+  if (when_ns > wheel_base_ns)
+    tick = (when_ns - wheel_base_ns + TIMER_TICK_NS - 1) / TIMER_TICK_NS;
+  timer_add_tick(t, tick);
+}
+
+void timer_del(struct timer *t)
+{
+  if (!timer_pending(t))
+    return;
+
+  list_unlink(t);
+  wheel_pending--;
+}
+
+/*
+ * Move all the timers of one slot of `level` to lower levels.  Returns the
+ * slot index so the caller knows whether this level wrapped as well.
+ */
+
+static int cascade(int level, int index)
+{
+  struct timer *head = &wheel[level][index];
+
+  while (head->next != head) {
+    struct timer *t = head->next;
+    list_unlink(t);
+    wheel_insert(t);
+  }
+
+  return index;
+}
+
+/*
+ * Advance the wheel up to and including tick `target`, running every
+ * timer that expires on the way.
+ */
+
+static void wheel_advance(uint64_t target)
+{
+  while (wheel_now <= target) {
+    int index = wheel_now & WHEEL_MASK;
+    int level;
+
+    if (index == 0) {
+      for (level = 1; level < WHEEL_LEVELS; level++)
+	if (cascade(level, LEVEL_INDEX(wheel_now, level)) != 0)
+	  break;
+    }
+
+    struct timer *head = &wheel[0][index];
+    wheel_now++;
+
+    while (head->next != head) {
+      struct timer *t = head->next;
+      list_unlink(t);
+      wheel_pending--;
+      t->fn(t);
+    }
+  }
+}
+
+/*
+ * Find the next tick the wheel must be serviced at.  This is the first
+ * non-empty slot of level 0, or the next time level 0 wraps around if
+ * timers are waiting on the higher levels.
+ */
+
+static uint64_t wheel_next(void)
+{
+  uint64_t boundary = wheel_now;
+  uint64_t t;
+
+  if (wheel_now & WHEEL_MASK)
+    boundary = (wheel_now | WHEEL_MASK) + 1;
+
+  for (t = wheel_now; t < wheel_now + WHEEL_SIZE; t++) {
+    struct timer *head = &wheel[0][t & WHEEL_MASK];
+    if (head->next != head)
+      return t < boundary ? t : boundary;
+  }
+
+  return boundary;
+}
+
+int timers_open(void)
+{
+  int level, i;
+
+  for (level = 0; level < WHEEL_LEVELS; level++) {
+    for (i = 0; i < WHEEL_SIZE; i++) {
+      wheel[level][i].next = &wheel[level][i];
+      wheel[level][i].prev = &wheel[level][i];
+    }
+  }
+
+  wheel_base_ns = now_ns();
+  wheel_now = 0;
+  wheel_pending = 0;
+  wheel_is_armed = 0;
+
+  wheel_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (wheel_fd < 0) {
+    perror("timerfd_create");
+    return -1;
+  }
+
+  return wheel_fd;
+}
+
+int timers_fd(void)
+{
+  return wheel_fd;
+}
+
+/*
+ * Called when the timerfd is readable: run everything that is due.
+ */
+
+void timers_run(void)
+{
+  uint64_t expirations;
+
+  if (read(wheel_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+    perror("read timerfd");
+
+  wheel_is_armed = 0;
+  wheel_advance(timers_now());
+}
+
+/*
+ * Re-arm the timerfd for the next tick with work to do.  This is called
+ * once per iteration of the main loop, so a burst of Note-On events
+ * costs at most one timerfd_settime().
+ */
+
+void timers_update(void)
+{
+  struct itimerspec its;
+  uint64_t next, ns;
+
+  memset(&its, 0, sizeof(its));
+
+  if (wheel_pending == 0) {
+    if (wheel_is_armed) {
+      timerfd_settime(wheel_fd, TFD_TIMER_ABSTIME, &its, NULL);
+      wheel_is_armed = 0;
+    }
+    return;
+  }
+
+  next = wheel_next();
+  if (wheel_is_armed && next == wheel_armed)
+    return;
+
+  // tick N is processed once the clock has reached the start of tick N
+  ns = wheel_base_ns + next * TIMER_TICK_NS;
+  its.it_value.tv_sec = ns / 1000000000ULL;
+  its.it_value.tv_nsec = ns % 1000000000ULL;
+
+  if (timerfd_settime(wheel_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+    perror("timerfd_settime");
+  else {
+    wheel_is_armed = 1;
+    wheel_armed = next;
+  }
+}
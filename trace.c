@@ -0,0 +1,129 @@
+/*
+ * MIDI2GPIOD
+ *
+ * Event trace recorder.
+ *
+ * With `--record FILE` every event received from the sequencer is
+ * appended to a trace, with the time it arrived, so that what happened
+ * on stage can be replayed later.  The file is created at its full size
+ * at startup and mapped into memory; recording an event is a copy into
+ * the next slot of the ring and no system call.  The kernel writes the
+ * pages back in its own time, and they survive a crash of the program.
+ *
+ * McLaren Labs
+ * 2021
+ *
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "midi2gpiod.h"
+
+_Static_assert(sizeof(struct trace_header) == TRACE_RECORD_SIZE, "trace header size");
+_Static_assert(sizeof(struct trace_record) == TRACE_RECORD_SIZE, "trace record size");
+
+char *trace_file = NULL;
+unsigned int trace_nrecords = 65536;
+
+unsigned long stat_trace_truncated;	// SysEx longer than TRACE_DATA
+
+static struct trace_header *trace_hdr;
+static struct trace_record *trace_ring;
+static size_t trace_size;
+
+/*
+ * Create the trace file with room for `nrecords` events and map it.
+ * Returns 0 on success.
+ */
+
+int trace_open(const char *path, unsigned int nrecords)
+{
+  int fd, err;
+
+  if (nrecords == 0) {
+    fprintf(stderr, "%s: trace needs at least one record\n", path);
+    return -1;
+  }
+
+  fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    perror(path);
+    return -1;
+  }
+
+  // allocate the blocks now, so that a full disk is an error here and
+  // not a SIGBUS on stage
+  trace_size = (size_t) (nrecords + 1) * TRACE_RECORD_SIZE;
+  err = posix_fallocate(fd, 0, trace_size);
+  if (err) {
+    fprintf(stderr, "%s: %s\n", path, strerror(err));
+    close(fd);
+    return -1;
+  }
+
+  trace_hdr = mmap(NULL, trace_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (trace_hdr == MAP_FAILED) {
+    perror(path);
+    trace_hdr = NULL;
+    return -1;
+  }
+
+  memset(trace_hdr, 0, sizeof(*trace_hdr));
+  memcpy(trace_hdr->magic, TRACE_MAGIC, sizeof(trace_hdr->magic));
+  trace_hdr->version = TRACE_VERSION;
+  trace_hdr->record_size = TRACE_RECORD_SIZE;
+  trace_hdr->nrecords = nrecords;
+  trace_hdr->start = now_ns();
+  trace_ring = (struct trace_record *) (trace_hdr + 1);
+
+  if (verbose)
+    printf("Recording to %s, last %u events\n", path, nrecords);
+  return 0;
+}
+
+/*
+ * Record one event that arrived at `now`.
+ */
+
+void trace_event(const snd_seq_event_t *ev, uint64_t now)
+{
+  struct trace_record *r;
+
+  if (!trace_hdr)
+    return;
+
+  r = &trace_ring[trace_hdr->count % trace_hdr->nrecords];
+  r->time = now;
+  r->ev = *ev;
+
+  if (snd_seq_ev_is_variable(ev)) {
+    unsigned int len = ev->data.ext.len;
+    if (len > TRACE_DATA) {
+      len = TRACE_DATA;
+      stat_trace_truncated++;
+    }
+    memcpy(r->data, ev->data.ext.ptr, len);
+    r->ev.data.ext.len = len;
+    r->ev.data.ext.ptr = NULL;
+  }
+
+  // the count goes last, so a reader never sees a half-written record
+  // as complete
+  __atomic_store_n(&trace_hdr->count, trace_hdr->count + 1, __ATOMIC_RELEASE);
+}
+
+void trace_close(void)
+{
+  if (!trace_hdr)
+    return;
+
+  if (verbose)
+    printf("Recorded %llu events\n", (unsigned long long) trace_hdr->count);
+
+  msync(trace_hdr, trace_size, MS_ASYNC);
+  munmap(trace_hdr, trace_size);
+  trace_hdr = NULL;
+}
@@ -0,0 +1,237 @@
+/*
+ * MIDI2GPIOD
+ *
+ * Writer threads.
+ *
+ * With `--writer` the GPIO writes move out of the main loop.  The main
+ * loop reads the sequencer and updates the shadow state as before, but
+ * at the end of an iteration output_commit() only queues a snapshot of
+ * the state and of the outputs that changed.  Every chip has a writer
+ * thread of its own, which owns the line request of the chip and takes
+ * the snapshots off its own queue.  A slow chip (an expander on I2C)
+ * delays its lines but never the reading of the sequencer, and chips on
+ * different buses are written at the same time: a commit that touches
+ * four expanders takes as long as the slowest of them.
+ *
+ * Each queue is a ring with one producer and one consumer, and needs no
+ * lock.  When a writer falls behind, consecutive snapshots that change
+ * different outputs are merged and written together; a snapshot that
+ * changes an output again is written separately, so no pulse is lost.
+ * Only if a queue fills up does the main loop keep the changes in the
+ * shadow state and try again on the next tick; by then the writer is
+ * hundreds of commits behind, and the latest state is what matters.
+ *
+ * McLaren Labs
+ * 2021
+ *
+ */
+
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "midi2gpiod.h"
+
+#define WRITER_QUEUE	256	// snapshots; a power of two
+
+struct snapshot {
+  struct outset	state;
+  struct outset	dirty;
+  unsigned char	level[MAX_OUTPUTS];	// DMX levels, by output
+};
+
+struct writer {
+  struct out_chip	*chip;
+  pthread_t		thread;
+  int			efd;
+  uint32_t		head;		// written by the main loop
+  uint32_t		tail;		// written by the writer
+  unsigned long		coalesced;
+  struct snapshot	queue[WRITER_QUEUE];
+};
+
+int writer_enabled = 0;
+
+unsigned long stat_writer_hwm;		// deepest a queue has been
+unsigned long stat_writer_full;		// commits deferred on a full queue
+unsigned long stat_writer_coalesced;	// snapshots merged into another
+
+static struct writer *writers[MAX_CHIPS];
+static int nwriters;
+static int writer_stop;
+
+static void *writer_main(void *arg)
+{
+  struct writer *w = arg;
+  uint64_t n;
+
+  for (;;) {
+    uint32_t tail = w->tail;
+    uint32_t head = __atomic_load_n(&w->head, __ATOMIC_ACQUIRE);
+
+    if (tail == head) {
+      if (__atomic_load_n(&writer_stop, __ATOMIC_ACQUIRE))
+	break;
+      if (read(w->efd, &n, sizeof(n)) < 0 && errno != EINTR) {
+	perror("writer");
+	break;
+      }
+      continue;
+    }
+
+    struct snapshot s = w->queue[tail++ % WRITER_QUEUE];
+
+    // merge the snapshots queued behind this one while they change
+    // other outputs
+    while (tail != head) {
+      const struct snapshot *next = &w->queue[tail % WRITER_QUEUE];
+      int i;
+
+      if (outset_overlap(&s.dirty, &next->dirty))
+	break;
+      for (i = 0; i < OUTSET_WORDS; i++) {
+	s.state.w[i] = next->state.w[i];
+	s.dirty.w[i] |= next->dirty.w[i];
+      }
+      memcpy(s.level, next->level, sizeof(s.level));
+      tail++;
+      __atomic_store_n(&w->coalesced, w->coalesced + 1, __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&w->tail, tail, __ATOMIC_RELEASE);
+    w->chip->level = s.level;
+    chip_write(w->chip, &s.state);
+    w->chip->level = NULL;
+  }
+
+  return NULL;
+}
+
+/*
+ * Queue the state for the writers of the chips with an output in
+ * `dirty`.  Returns 0, or -1 if one of their queues is full, in which
+ * case nothing is queued.
+ */
+
+int writer_push(const struct outset *state, const struct outset *dirty)
+{
+  uint64_t one = 1;
+  int i;
+
+  for (i = 0; i < nwriters; i++) {
+    struct writer *w = writers[i];
+
+    if (outset_overlap(&w->chip->mask, dirty) &&
+	w->head - __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE) == WRITER_QUEUE) {
+      stat_writer_full++;
+      return -1;
+    }
+  }
+
+  for (i = 0; i < nwriters; i++) {
+    struct writer *w = writers[i];
+    struct snapshot *s = &w->queue[w->head % WRITER_QUEUE];
+    uint32_t depth;
+    int j;
+
+    if (!outset_overlap(&w->chip->mask, dirty))
+      continue;
+
+    s->state = *state;
+    s->dirty = *dirty;
+    // the writer never reads outputs[], which the main loop changes
+    for (j = 0; j < w->chip->nouts; j++)
+      s->level[w->chip->outs[j]] = outputs[w->chip->outs[j]].level;
+    __atomic_store_n(&w->head, w->head + 1, __ATOMIC_RELEASE);
+
+    depth = w->head - __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE);
+    if (depth > stat_writer_hwm)
+      stat_writer_hwm = depth;
+
+    if (write(w->efd, &one, sizeof(one)) < 0)
+      perror("writer_push");
+  }
+
+  return 0;
+}
+
+/*
+ * Start a writer thread for every chip.  The lines must already be
+ * requested.  Returns 0 on success.
+ */
+
+int writer_start(void)
+{
+  int c, err;
+
+  for (c = 0; c < nchips; c++) {
+    struct writer *w = calloc(1, sizeof(*w));
+
+    if (!w) {
+      perror("writer_start");
+      return -1;
+    }
+
+    w->chip = &chips[c];
+    w->efd = eventfd(0, EFD_CLOEXEC);
+    if (w->efd < 0) {
+      perror("eventfd");
+      free(w);
+      return -1;
+    }
+
+    err = pthread_create(&w->thread, NULL, writer_main, w);
+    if (err) {
+      fprintf(stderr, "Start writer thread for '%s' failed: %s\n",
+	      chips[c].name, strerror(err));
+      close(w->efd);
+      free(w);
+      return -1;
+    }
+
+    chips[c].writer = w;
+    writers[nwriters++] = w;
+  }
+
+  return 0;
+}
+
+/*
+ * Snapshots merged so far, by the running writers and the joined ones.
+ */
+
+unsigned long writer_coalesced(void)
+{
+  unsigned long n = stat_writer_coalesced;
+  int i;
+
+  for (i = 0; i < nwriters; i++)
+    n += __atomic_load_n(&writers[i]->coalesced, __ATOMIC_RELAXED);
+  return n;
+}
+
+/*
+ * Let the writers finish what is queued, and wait for them.
+ */
+
+void writer_join(void)
+{
+  uint64_t one = 1;
+  int i;
+
+  __atomic_store_n(&writer_stop, 1, __ATOMIC_RELEASE);
+
+  for (i = 0; i < nwriters; i++)
+    if (write(writers[i]->efd, &one, sizeof(one)) < 0)
+      perror("writer_join");
+
+  for (i = 0; i < nwriters; i++) {
+    struct writer *w = writers[i];
+
+    pthread_join(w->thread, NULL);
+    close(w->efd);
+    stat_writer_coalesced += w->coalesced;
+    w->chip->writer = NULL;
+    free(w);
+  }
+  nwriters = 0;
+}